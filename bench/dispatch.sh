@@ -0,0 +1,18 @@
+#!/bin/sh
+# Times the VM benchmarks with threaded dispatch and with the switch
+# fallback, both with the JIT off, then with the JIT and on the
+# tree-walking evaluator. Run from the repository root.
+set -e
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+$CC $CFLAGS -o bench/lisp_threaded main.c mpc.c
+$CC $CFLAGS -DLISP_SWITCH_DISPATCH -o bench/lisp_switch main.c mpc.c
+for f in bench/fib.lspy bench/loop.lspy; do
+    for run in "bench/lisp_threaded --no-jit" "bench/lisp_switch --no-jit" "bench/lisp_threaded" "bench/lisp_threaded --no-vm"; do
+        start=$(date +%s.%N)
+        $run $f < /dev/null > /dev/null
+        end=$(date +%s.%N)
+        awk "BEGIN { printf \"%-16s %-28s %.3fs\\n\", \"$f\", \"$run\", $end - $start }"
+    done
+done
+rm -f bench/lisp_threaded bench/lisp_switch
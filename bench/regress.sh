@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs every program in bench/regress on the tree-walking evaluator, on
+# the VM without the JIT and in the default mode, and fails if their
+# output or exit status differ. Run from the repository root.
+set -e
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+$CC $CFLAGS -o bench/lisp_regress main.c mpc.c
+status=0
+for f in bench/regress/*.lspy; do
+    bench/lisp_regress --no-vm $f < /dev/null > bench/regress.want 2>&1 && rc=0 || rc=$?
+    echo "exit $rc" >> bench/regress.want
+    for mode in "--no-jit" ""; do
+        bench/lisp_regress $mode $f < /dev/null > bench/regress.got 2>&1 && rc=0 || rc=$?
+        echo "exit $rc" >> bench/regress.got
+        if diff -u bench/regress.want bench/regress.got > bench/regress.diff; then
+            printf "%-32s %-10s ok\n" "$f" "${mode:-default}"
+        else
+            printf "%-32s %-10s FAIL\n" "$f" "${mode:-default}"
+            cat bench/regress.diff
+            status=1
+        fi
+    done
+done
+rm -f bench/lisp_regress bench/regress.want bench/regress.got bench/regress.diff
+exit $status
@@ -1,19 +1,30 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 #include "mpc.h"
 
+// hot lambdas are compiled to native code on x86-64 systems with mmap,
+// unless the build defines LISP_NO_JIT
+#if defined(__x86_64__) && defined(__unix__) && !defined(LISP_NO_JIT)
+#define VM_JIT
+#include <sys/mman.h>
+#endif
+
 // #define LASSERT(args, cond, err) \
 //     if (!(cond)) { lval_delete(args); return lval_make_error(err); }
 
 #define LASSERT(args, cond, err_format, ...) \
-    if (!(cond)) { lval *err = lval_make_error(err_format, ##__VA_ARGS__); lval_delete(args); return err; }
+    if (!(cond)) { return lval_make_error(err_format, ##__VA_ARGS__); }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-    LASSERT(args, args->cell[index]->type == expect, \
+    LASSERT(args, LVAL_TYPE(args->cell[index]) == expect, \
     "Function '%s' passed incorrect type for argument %i. " \
     "Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(LVAL_TYPE(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
     LASSERT(args, args->count == num, \
@@ -30,34 +41,146 @@ static char buffer[2048];
 
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+// builtins that lval_call_builtin evaluates inline, LOP_CALL for the rest
+enum {LOP_CALL, LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_LT, LOP_LE, LOP_GT, LOP_GE, LOP_EQ, LOP_NE};
+
+// Every builtin is described once in lval_builtins. When argc >= 0,
+// lval_call_builtin checks the argument count and the types of the first
+// argc arguments before anything runs, so func can rely on them; argc -1
+// leaves all checking to func.
+#define LBUILTIN_MAX_ARGS 3
+#define LVAL_ANY -1
+
+typedef struct {
+    char *name;
+    lbuiltin func;
+    int op;
+    int argc;
+    int types[LBUILTIN_MAX_ARGS];
+} lbuiltin_desc;
+
+// symbol names are interned, so two symbols are equal iff their lsym is
+// local is set once the name has been bound outside the global environment,
+// constant while its global binding was made by defconst or is a builtin
+typedef struct lsym {
+    char *name;
+    unsigned long hash;
+    int local;
+    int constant;
+} lsym;
+
+#define LERR_MAX_ARGS 4
+
+typedef union {
+    long num;
+    const char *str;
+} lerr_arg;
+
+// Entries live in syms/vals in insertion order. Small frames keep them in
+// the inline arrays; once an environment has more than LENV_INDEX_MIN
+// entries, index maps symbol hashes to entry number + 1 (0 is empty).
+// Copies share syms, vals and index until one of them binds something:
+// shared then counts the environments using them, and is NULL while an
+// environment owns its arrays alone.
+#define LENV_INLINE 4
+#define LENV_INDEX_MIN 8
+
 struct lenv {
+    int type;
+    int mark;
     lenv *par;
 
     int count;
-    char **syms;
+    int cap;
+    lsym **syms;
     lval **vals;
+
+    int *index;
+    int index_cap;
+    int *shared;
+
+    lsym *inline_syms[LENV_INLINE];
+    lval *inline_vals[LENV_INLINE];
 };
 
 struct lval {
     int type;
-
-    long num;
-    char *err;
-    char *sym;
-    char *str;
-
-    lbuiltin builtin;
-    lenv *env;
-    lval *formals;
-    lval *body;
-
-    int count;
-    struct lval** cell;    
+    int mark;
+
+    union {
+        long num;
+        char *str;
+
+        // slot >= 0 is a hint that the symbol is entry slot of the frame
+        // depth levels up; lval_eval checks it before trusting it. Hints
+        // past the call frame are only valid in frames whose parent is
+        // scope, and only until lenv_shadow_epoch moves on from epoch.
+        // depth < 0 marks a reference to a global constant, which holds
+        // its value directly while lenv_const_epoch stays at epoch and no
+        // frame has bound its name.
+        // gslot caches the global slot of sym while gversion is current.
+        struct {
+            lsym *sym;
+            int depth;
+            int slot;
+            union {
+                lenv *scope;
+                lval *constant;
+            };
+            long epoch;
+            long gversion;
+            int gslot;
+        };
+
+        // err stays NULL until lval_error_message formats it
+        struct {
+            const char *format;
+            char *err;
+            lval *culprit;
+            lerr_arg args[LERR_MAX_ARGS];
+        };
+
+        // env is the environment the lambda was made in. arity >= 0 when
+        // formals are that many distinct plain symbols, so a full call can
+        // lay its arguments out as the frame directly. A partial application
+        // has target set: it stands for target applied to the arguments in
+        // bound, and keeps the remaining formals and the body for printing.
+        // code is the compiled body, NULL if the lambda runs on lval_eval.
+        struct {
+            lbuiltin builtin;
+            union {
+                lenv *env;
+                lval *bound;
+            };
+            union {
+                lval *formals;
+                const lbuiltin_desc *desc;
+            };
+            lval *body;
+            lval *target;
+            lcode *code;
+            int arity;
+        };
+
+        struct {
+            int count;
+            struct lval** cell;
+        };
+    };
 };
 
+// every type allocates only the header plus its own member of the union
+#define LVAL_SIZE_NUM  (offsetof(lval, num) + sizeof(long))
+#define LVAL_SIZE_STR  (offsetof(lval, str) + sizeof(char*))
+#define LVAL_SIZE_SYM  (offsetof(lval, gslot) + sizeof(int))
+#define LVAL_SIZE_ERR  (offsetof(lval, args) + sizeof(lerr_arg) * LERR_MAX_ARGS)
+#define LVAL_SIZE_FUN  (offsetof(lval, arity) + sizeof(int))
+#define LVAL_SIZE_EXPR (offsetof(lval, cell) + sizeof(lval**))
+
 mpc_parser_t *Number;
 mpc_parser_t *Symbol;
 mpc_parser_t *String;
@@ -69,18 +192,52 @@ mpc_parser_t *Lispy;
 
 enum {LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_BOOL, LVAL_STR};
 
+// heap tags that only the collector sees: environments and free slab slots
+enum {LVAL_ENV = 64, LVAL_FREE};
+
+// bits of the mark word shared by lval and lenv
+#define GC_MARKED 1
+#define GC_OLD 2
+#define GC_REMEMBERED 4
+#define GC_SEEN 8
+#define GC_HASHED 16
+
+// small numbers and booleans are stored in the lval* word itself:
+//   ...xxx1  fixnum, value in the upper bits
+//   ...b10   boolean b
+//   ...xx00  pointer to a heap lval
+#define LVAL_IS_FIXNUM(v) (((uintptr_t)(v) & 1) != 0)
+#define LVAL_IS_BOOL(v) (((uintptr_t)(v) & 3) == 2)
+#define LVAL_IS_IMMEDIATE(v) (((uintptr_t)(v) & 3) != 0)
+
+#define LVAL_FIXNUM_MIN (LONG_MIN / 2)
+#define LVAL_FIXNUM_MAX (LONG_MAX / 2)
+#define LVAL_FIXNUM(x) ((lval*)(((uintptr_t)(x) << 1) | 1))
+#define LVAL_FIXNUM_VALUE(v) ((long)((intptr_t)(v) >> 1))
+
+#define LVAL_TRUE ((lval*)(uintptr_t)6)
+#define LVAL_FALSE ((lval*)(uintptr_t)2)
+
+#define LVAL_TYPE(v) \
+    (LVAL_IS_FIXNUM(v) ? LVAL_NUM : LVAL_IS_BOOL(v) ? LVAL_BOOL : (v)->type)
+
+#define LVAL_GET_NUM(v) \
+    (LVAL_IS_FIXNUM(v) ? LVAL_FIXNUM_VALUE(v) : \
+     LVAL_IS_BOOL(v) ? (long)((uintptr_t)(v) >> 2) : (v)->num)
+
 lval *lval_make_num(long x);
-lval *lval_make_error(char *format, ...);
+lval *lval_make_error(const char *format, ...);
 lval *lval_make_sym(char *sym);
 lval *lval_make_str(char *str);
 lval *lval_make_s_expr();
 lval *lval_make_q_expr();
-lval *lval_make_fun(lbuiltin func);
+lval *lval_make_fun(const lbuiltin_desc *desc);
+lval *lval_call_builtin(lenv *env, lval *fun, lval *a);
+lval *lval_run(lenv *frame, lval *fun);
+lcode *lval_compile(lval *body);
+void lcode_free(lcode *code);
 lval *lval_make_lambda(lval *formals, lval *body);
 lenv *lenv_make();
-void lval_delete(lval *cur);
-lval *lval_copy(lval *cur);
-void lenv_delete(lenv *cur);
 lval *lval_add(lval *x, lval *add);
 lval *lenv_get(lenv *env, lval *cur);
 void lenv_put(lenv *env, lval *cur_name, lval *cur_fun);
@@ -89,19 +246,22 @@ lval *lval_list_builtin(lenv *env, lval *cur);
 lval *lval_eval_builtin(lenv *env, lval *cur);
 
 lenv *lenv_copy(lenv *cur);
+lenv *lenv_make_frame(lval *fun);
 void lenv_def(lenv *env, lval *name, lval *fun);
-lval *lval_copy(lval *cur);
 lval *lval_pop(lval *cur, int ind);
-lval *lval_take(lval *cur, int ind);
 lval *lval_fun_builtin(lenv *env, lval *cur);
 lval *lval_eval_s_expression(lenv *env, lval *cur);
 lval *lval_eval(lenv *env, lval *cur);
 
 void lval_print(lval *cur);
+char *lval_error_message(lval *cur);
+
+void gc_track_young(void *obj, int size);
+void hashcons_remove(lval *cur);
 
 char *readline(char *prompt) {
     fputs(prompt, stdout);
-    fgets(buffer, 2048, stdin);
+    if (fgets(buffer, 2048, stdin) == NULL) return NULL;
     size_t buf_len = strlen(buffer) + 1;
     char *cpy = malloc(buf_len * sizeof(char));
     strncpy(cpy, buffer, strlen(buffer));
@@ -111,131 +271,915 @@ char *readline(char *prompt) {
 
 void add_history(){}
 
+// lval and lenv nodes are carved out of page-sized slabs, one free list per
+// size class, so the evaluator's constant churn of tiny objects never reaches malloc
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_ALIGN 8
+#define SLAB_CLASSES 16
+
+typedef struct slab_page slab_page;
+
+struct slab_page {
+    slab_page *next;
+    int size;
+    int used;
+    char *bump;
+    char *end;
+};
+
+typedef struct {
+    void *free;
+    slab_page *pages;
+    long page_count;
+    long live;
+} slab_class;
+
+static _Thread_local slab_class slab_classes[SLAB_CLASSES];
+static _Thread_local long slab_live_lvals;
+static _Thread_local long slab_live_lenvs;
+
+#define SLAB_CLASS(size) (((size) + SLAB_ALIGN - 1) / SLAB_ALIGN - 1)
+#define SLAB_CLASS_SIZE(cls) (((cls) + 1) * SLAB_ALIGN)
+#define SLAB_PAGE_HEADER ((sizeof(slab_page) + 15) & ~(size_t)15)
+
+slab_page *slab_page_make(int size) {
+    slab_page *page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL) {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    page->size = size;
+    page->used = 0;
+    page->bump = (char*)page + SLAB_PAGE_HEADER;
+    page->end = (char*)page + SLAB_PAGE_SIZE - (SLAB_PAGE_SIZE - SLAB_PAGE_HEADER) % size;
+    return page;
+}
+
+#define SLAB_PAGE_OF(ptr) ((slab_page*)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+
+void *slab_alloc(size_t size) {
+    int cls = SLAB_CLASS(size);
+    assert(cls < SLAB_CLASSES);
+    slab_class *sc = &slab_classes[cls];
+    void *ans = sc->free;
+
+    if (ans != NULL) {
+        sc->free = ((void**)ans)[1];
+    }
+    else {
+        slab_page *page = sc->pages;
+        if (page == NULL || page->bump == page->end) {
+            page = slab_page_make(SLAB_CLASS_SIZE(cls));
+            page->next = sc->pages;
+            sc->pages = page;
+            sc->page_count++;
+        }
+        ans = page->bump;
+        page->bump += page->size;
+    }
+
+    SLAB_PAGE_OF(ans)->used++;
+    sc->live++;
+    return ans;
+}
+
+void slab_free(void *ptr, size_t size) {
+    slab_class *sc = &slab_classes[SLAB_CLASS(size)];
+    SLAB_PAGE_OF(ptr)->used--;
+    sc->live--;
+    // the first word keeps a LVAL_FREE tag so the sweeper can skip the slot
+    ((lval*)ptr)->type = LVAL_FREE;
+    ((void**)ptr)[1] = sc->free;
+    sc->free = ptr;
+}
+
+size_t lval_size(int type) {
+    switch (type) {
+        case LVAL_BOOL:
+        case LVAL_NUM:
+            return LVAL_SIZE_NUM;
+        case LVAL_ERR:
+            return LVAL_SIZE_ERR;
+        case LVAL_SYM:
+            return LVAL_SIZE_SYM;
+        case LVAL_STR:
+            return LVAL_SIZE_STR;
+        case LVAL_FUN:
+            return LVAL_SIZE_FUN;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return LVAL_SIZE_EXPR;
+        default:
+            return sizeof(lval);
+    }
+}
+
+lval *lval_alloc(int type) {
+    lval *ans = slab_alloc(lval_size(type));
+    ans->type = type;
+    slab_live_lvals++;
+    gc_track_young(ans, lval_size(type));
+    return ans;
+}
+
+void lval_free(lval *cur) {
+    slab_free(cur, lval_size(cur->type));
+    slab_live_lvals--;
+}
+
+lenv *lenv_alloc() {
+    lenv *ans = slab_alloc(sizeof(lenv));
+    ans->type = LVAL_ENV;
+    slab_live_lenvs++;
+    gc_track_young(ans, sizeof(lenv));
+    return ans;
+}
+
+void lenv_free(lenv *cur) {
+    slab_free(cur, sizeof(lenv));
+    slab_live_lenvs--;
+}
+
 lval *lval_make_num(long x) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_NUM;
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX)
+        return LVAL_FIXNUM(x);
+
+    lval *ans = lval_alloc(LVAL_NUM);
     ans->num = x;
     return ans;
 }
 
-lval *lval_make_error(char *format, ...) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_ERR;
-    ans->err = malloc(512);
+// Errors keep their format and raw arguments; the text is only built when
+// someone looks at it. format must be a string literal: %s takes a static
+// string, %i an int and %v a symbol or string lval that the error keeps
+// alive. Errors without arguments are shared, one per format.
+#define LERR_SINGLETONS 16
+
+static const char *lerr_singleton_formats[LERR_SINGLETONS];
+static lval *lerr_singletons[LERR_SINGLETONS];
+static int lerr_singleton_count;
+
+void gc_register_root(void *obj);
+
+lval *lval_make_error(const char *format, ...) {
+    int has_args = strchr(format, '%') != NULL;
+    if (!has_args) {
+        for (int i = 0;i < lerr_singleton_count;i++)
+            if (lerr_singleton_formats[i] == format) return lerr_singletons[i];
+    }
+
+    lval *ans = lval_alloc(LVAL_ERR);
+    ans->format = format;
+    ans->err = NULL;
+    ans->culprit = NULL;
+
     va_list v;
     va_start(v, format);
-    vsnprintf(ans->err, 511, format, v);
-    ans->err = realloc(ans->err, strlen(ans->err) + 1);
+    int argc = 0;
+    for (const char *p = format;*p && argc < LERR_MAX_ARGS;p++) {
+        if (*p != '%') continue;
+        p++;
+        if (*p == 's') ans->args[argc++].str = va_arg(v, const char*);
+        if (*p == 'i') ans->args[argc++].num = va_arg(v, int);
+        if (*p == 'v') {
+            ans->culprit = va_arg(v, lval*);
+            argc++;
+        }
+    }
     va_end(v);
+
+    if (!has_args && lerr_singleton_count < LERR_SINGLETONS) {
+        gc_register_root(ans);
+        lerr_singleton_formats[lerr_singleton_count] = format;
+        lerr_singletons[lerr_singleton_count++] = ans;
+    }
+    return ans;
+}
+
+char *lval_error_message(lval *cur) {
+    if (cur->err != NULL) return cur->err;
+
+    char buf[512];
+    int len = 0;
+    int argc = 0;
+    for (const char *p = cur->format;*p && len < 511;p++) {
+        if (*p != '%' || p[1] == '\0' || argc == LERR_MAX_ARGS) {
+            buf[len++] = *p;
+            continue;
+        }
+        p++;
+        const char *str = NULL;
+        char num[32];
+        if (*p == 's') str = cur->args[argc++].str;
+        else if (*p == 'i') {
+            snprintf(num, sizeof(num), "%li", cur->args[argc++].num);
+            str = num;
+        }
+        else if (*p == 'v') {
+            argc++;
+            str = LVAL_TYPE(cur->culprit) == LVAL_SYM ? cur->culprit->sym->name : cur->culprit->str;
+        }
+        else {
+            buf[len++] = *p;
+            continue;
+        }
+        for (;*str && len < 511;str++) buf[len++] = *str;
+    }
+    buf[len] = '\0';
+
+    cur->err = malloc(len + 1);
+    memcpy(cur->err, buf, len + 1);
+    return cur->err;
+}
+
+unsigned long lval_hash_str(char *str) {
+    unsigned long h = 1469598103934665603UL;
+    for (;*str;str++) h = (h ^ (unsigned char)*str) * 1099511628211UL;
+    return h;
+}
+
+// process-wide symbol table, entries live until exit
+static lsym **lsym_table;
+static long lsym_cap;
+static long lsym_count;
+
+static lsym *lsym_varargs;
+
+lsym *lsym_intern(char *name) {
+    if ((lsym_count + 1) * 2 >= lsym_cap) {
+        lsym **old = lsym_table;
+        long old_cap = lsym_cap;
+        lsym_cap = lsym_cap ? lsym_cap * 2 : 256;
+        lsym_table = calloc(lsym_cap, sizeof(lsym*));
+        for (long i = 0;i < old_cap;i++) {
+            if (old[i] == NULL) continue;
+            long j = old[i]->hash & (lsym_cap - 1);
+            while (lsym_table[j] != NULL) j = (j + 1) & (lsym_cap - 1);
+            lsym_table[j] = old[i];
+        }
+        free(old);
+    }
+
+    unsigned long hash = lval_hash_str(name);
+    long i = hash & (lsym_cap - 1);
+    for (;lsym_table[i] != NULL;i = (i + 1) & (lsym_cap - 1))
+        if (lsym_table[i]->hash == hash && strcmp(lsym_table[i]->name, name) == 0)
+            return lsym_table[i];
+
+    lsym *ans = malloc(sizeof(lsym));
+    ans->name = malloc(strlen(name) + 1);
+    strcpy(ans->name, name);
+    ans->hash = hash;
+    ans->local = 0;
+    ans->constant = 0;
+    lsym_table[i] = ans;
+    lsym_count++;
     return ans;
 }
 
 lval *lval_make_sym(char *sym) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_SYM;
-    ans->sym = malloc(strlen(sym) + 1);
-    strcpy(ans->sym, sym);
+    lval *ans = lval_alloc(LVAL_SYM);
+    ans->sym = lsym_intern(sym);
+    ans->depth = 0;
+    ans->slot = -1;
+    ans->scope = NULL;
+    ans->epoch = 0;
+    ans->gversion = -1;
+    ans->gslot = -1;
     return ans;
 }
 
 lval *lval_make_s_expr() {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_SEXPR;
+    lval *ans = lval_alloc(LVAL_SEXPR);
     ans->count = 0;
     ans->cell = NULL;
     return ans;
 }
 
 lval *lval_make_q_expr() {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_QEXPR;
+    lval *ans = lval_alloc(LVAL_QEXPR);
     ans->count = 0;
     ans->cell = NULL;
     return ans;
 }
 
-lval *lval_make_fun(lbuiltin func) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_FUN;
-    ans->builtin = func;
+lval *lval_make_fun(const lbuiltin_desc *desc) {
+    lval *ans = lval_alloc(LVAL_FUN);
+    ans->builtin = desc->func;
+    ans->desc = desc;
     return ans;
 }
 
+int lval_formals_arity(lval *formals) {
+    for (int i = 0;i < formals->count;i++) {
+        lval *x = formals->cell[i];
+        if (LVAL_TYPE(x) != LVAL_SYM || x->sym == lsym_varargs) return -1;
+        for (int j = 0;j < i;j++)
+            if (formals->cell[j]->sym == x->sym) return -1;
+    }
+    return formals->count;
+}
+
 lval *lval_make_lambda(lval *formals, lval *body) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_FUN;
+    lval *ans = lval_alloc(LVAL_FUN);
     ans->builtin = NULL;
-    ans->env = lenv_make();
+    ans->env = NULL;
     ans->formals = formals;
     ans->body = body;
+    ans->target = NULL;
+    ans->code = NULL;
+    ans->arity = lval_formals_arity(formals);
     return ans;
 }
 
 lval *lval_make_bool(int val) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_BOOL;
-    ans->num = val;
-    return ans;
+    return val ? LVAL_TRUE : LVAL_FALSE;
 }
 
 lval *lval_make_str(char *str) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = LVAL_STR;
+    lval *ans = lval_alloc(LVAL_STR);
     ans->str = malloc(strlen(str) + 1);
     strcpy(ans->str, str);
     return ans;
 }
 
 lenv *lenv_make() {
-    lenv *ans = malloc(sizeof(lenv));
+    lenv *ans = lenv_alloc();
     ans->par = NULL;
     ans->count = 0;
-    ans->syms = NULL;
-    ans->vals = NULL;
+    ans->cap = LENV_INLINE;
+    ans->syms = ans->inline_syms;
+    ans->vals = ans->inline_vals;
+    ans->index = NULL;
+    ans->index_cap = 0;
+    ans->shared = NULL;
     return ans;
 }
 
-void lval_delete(lval *cur) {
+// drops env's hold on its arrays, freeing them unless a copy still uses them
+void lenv_release(lenv *env) {
+    if (env->shared != NULL && --*env->shared > 0) return;
+    free(env->shared);
+    if (env->syms != env->inline_syms) {
+        free(env->syms);
+        free(env->vals);
+    }
+    free(env->index);
+}
+
+// Memory is reclaimed by a mark-and-sweep collector. Roots are the objects
+// registered with gc_register_root (the global environment) and the root
+// stack, where the evaluator pushes the expressions, argument lists and
+// environments it is working on. The collector only runs at gc_safe_point,
+// so C code must have pushed every value it still needs before it can reach
+// lval_eval_s_expression.
+//
+// The heap is split into two generations without moving anything: every new
+// object is logged in the nursery, and a minor collection marks only nursery
+// objects (GC_SEEN), starting from the roots and the remembered set.
+// Survivors get the GC_OLD bit and stay where they are; the rest are freed.
+// Old objects that have a young value stored into them are recorded by
+// gc_write_barrier.
+//
+// The old generation is collected incrementally, a slice of at most
+// gc_budget_us per safe point. Marking is tri-color: GC_MARKED equal to
+// gc_black means grey or black, grey objects sit on gc_grey. gc_black flips
+// at the start of every cycle, which turns every object white without a pass
+// over the heap. While marking, gc_write_barrier shades every stored value,
+// and marking only ends after a rescan of the roots finds nothing new. The
+// sweep frees white old objects; young ones are left to minor collections.
+//
+// The nursery doubles as the arena of the top-level form being evaluated.
+// A value stored into an old environment escapes and is promoted right away
+// together with its young subtree, so gc_end_form can usually free what is
+// left of the nursery in one pass without tracing anything.
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_PAUSE_BUCKETS 6
+
+enum {GC_IDLE, GC_MARK, GC_SWEEP};
+
+typedef struct {
+    int type;
+    int mark;
+} gc_header;
+
+static void **gc_roots;
+static int gc_roots_count;
+
+static void **gc_stack;
+static int gc_stack_count;
+static int gc_stack_cap;
+
+static void **gc_grey;
+static int gc_grey_count;
+static int gc_grey_cap;
+
+static void **gc_young_grey;
+static int gc_young_grey_count;
+static int gc_young_grey_cap;
+
+static void **gc_young;
+static int gc_young_count;
+static int gc_young_cap;
+static long gc_young_bytes;
+
+static void **gc_remembered;
+static int gc_remembered_count;
+static int gc_remembered_cap;
+
+static int gc_phase = GC_IDLE;
+static int gc_black = GC_MARKED;
+static long gc_budget_us = 500;
+
+static int gc_sweep_class;
+static slab_page *gc_sweep_page;
+static char *gc_sweep_slot;
+static long gc_sweep_freed;
+
+static long gc_threshold = GC_MIN_HEAP;
+static long gc_collections;
+static long gc_minor_collections;
+static long gc_promoted_total;
+static long gc_arena_resets;
+static long gc_freed_total;
+
+// pauses under 10us, 100us, 1ms, 10ms, 100ms and the rest
+static long gc_pause_buckets[GC_PAUSE_BUCKETS];
+static long gc_pause_count;
+static long gc_pause_total;
+static long gc_pause_max;
+
+long slab_live_bytes() {
+    long ans = 0;
+    for (int i = 0;i < SLAB_CLASSES;i++) ans += slab_classes[i].live * SLAB_CLASS_SIZE(i);
+    return ans;
+}
+
+long gc_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void gc_promote(void *obj);
+
+void gc_register_root(void *obj) {
+    gc_roots = realloc(gc_roots, sizeof(void*) * (gc_roots_count + 1));
+    gc_roots[gc_roots_count++] = obj;
+    gc_promote(obj);
+}
+
+void gc_unregister_root(void *obj) {
+    for (int i = 0;i < gc_roots_count;i++) {
+        if (gc_roots[i] != obj) continue;
+        gc_roots[i] = gc_roots[--gc_roots_count];
+        return;
+    }
+}
+
+void gc_push(void *obj) {
+    if (gc_stack_count == gc_stack_cap) {
+        gc_stack_cap = gc_stack_cap ? gc_stack_cap * 2 : 256;
+        gc_stack = realloc(gc_stack, sizeof(void*) * gc_stack_cap);
+    }
+    gc_stack[gc_stack_count++] = obj;
+}
+
+void gc_pop_to(int count) {
+    gc_stack_count = count;
+}
+
+void gc_ptr_push(void ***arr, int *count, int *cap, void *obj) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        *arr = realloc(*arr, sizeof(void*) * *cap);
+    }
+    (*arr)[(*count)++] = obj;
+}
+
+// new objects are white while marking, so a live one is found through the
+// roots or the barrier; otherwise they get the colour that turns white at
+// the next flip
+void gc_track_young(void *obj, int size) {
+    ((gc_header*)obj)->mark = gc_phase == GC_MARK ? gc_black ^ GC_MARKED : gc_black;
+    gc_ptr_push(&gc_young, &gc_young_count, &gc_young_cap, obj);
+    gc_young_bytes += size;
+}
+
+void gc_remember(void *obj) {
+    gc_header *h = obj;
+    if (!(h->mark & GC_OLD) || (h->mark & GC_REMEMBERED)) return;
+    h->mark |= GC_REMEMBERED;
+    gc_ptr_push(&gc_remembered, &gc_remembered_count, &gc_remembered_cap, obj);
+}
+
+void gc_shade(void *obj) {
+    if (obj == NULL || LVAL_IS_IMMEDIATE(obj)) return;
+    gc_header *h = obj;
+    if ((h->mark & GC_MARKED) == gc_black) return;
+    h->mark ^= GC_MARKED;
+    gc_ptr_push(&gc_grey, &gc_grey_count, &gc_grey_cap, obj);
+}
+
+void gc_promote_push(void *obj) {
+    if (obj == NULL || LVAL_IS_IMMEDIATE(obj)) return;
+    gc_header *h = obj;
+    if (h->mark & GC_OLD) return;
+    int color = gc_phase == GC_MARK ? h->mark & GC_MARKED : gc_black;
+    h->mark = (h->mark & GC_HASHED) | color | GC_OLD;
+    gc_promoted_total++;
+    gc_ptr_push(&gc_young_grey, &gc_young_grey_count, &gc_young_grey_cap, obj);
+}
+
+void gc_mark_young(void *obj) {
+    if (obj == NULL || LVAL_IS_IMMEDIATE(obj)) return;
+    gc_header *h = obj;
+    if (h->mark & (GC_OLD | GC_SEEN)) return;
+    h->mark |= GC_SEEN;
+    gc_ptr_push(&gc_young_grey, &gc_young_grey_count, &gc_young_grey_cap, obj);
+}
+
+// must be called for every pointer stored into an existing object
+void gc_write_barrier(void *obj, void *val) {
+    if (val == NULL || LVAL_IS_IMMEDIATE(val)) return;
+    if (gc_phase == GC_MARK) gc_shade(val);
+    if (((gc_header*)val)->mark & GC_OLD) return;
+    gc_remember(obj);
+}
+
+void gc_trace(gc_header *obj, void (*mark)(void*));
+
+void gc_promote(void *obj) {
+    gc_promote_push(obj);
+    while (gc_young_grey_count > 0)
+        gc_trace(gc_young_grey[--gc_young_grey_count], gc_promote_push);
+}
+
+// stores into environments: a value put into an old one escapes the arena
+void gc_write_barrier_env(lenv *env, lval *val) {
+    if (val == NULL || LVAL_IS_IMMEDIATE(val)) return;
+    if (gc_phase == GC_MARK) gc_shade(val);
+    if (env->mark & GC_OLD) gc_promote(val);
+}
+
+void gc_trace(gc_header *obj, void (*mark)(void*)) {
+    if (obj->type == LVAL_ENV) {
+        lenv *env = (lenv*)obj;
+        mark(env->par);
+        for (int i = 0;i < env->count;i++) mark(env->vals[i]);
+        return;
+    }
+
+    lval *cur = (lval*)obj;
     switch (cur->type) {
-        case LVAL_BOOL: break;
-        case LVAL_NUM: break;
-        case LVAL_SYM:
-            free(cur->sym);
-            break;
-        case LVAL_FUN: 
+        case LVAL_FUN:
             if (cur->builtin == NULL) {
-                lenv_delete(cur->env);
-                lval_delete(cur->formals);
-                lval_delete(cur->body);
+                if (cur->target != NULL) {
+                    mark(cur->target);
+                    mark(cur->bound);
+                }
+                else
+                    mark(cur->env);
+                mark(cur->formals);
+                mark(cur->body);
             }
             break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0;i < cur->count;i++) mark(cur->cell[i]);
+            break;
         case LVAL_ERR:
-            free(cur->err);
+            mark(cur->culprit);
             break;
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            cur->count = 0;
-            for (int i = 0;i < cur->count;i++) free(cur->cell[i]);
-            free(cur->cell);
+        case LVAL_SYM:
+            if (cur->depth < 0)
+                mark(cur->constant);
+            else
+                mark(cur->scope);
+            break;
+    }
+}
+
+void gc_finalize(gc_header *obj) {
+    if (obj->mark & GC_HASHED) hashcons_remove((lval*)obj);
+    if (obj->type == LVAL_ENV) {
+        lenv *env = (lenv*)obj;
+        lenv_release(env);
+        lenv_free(env);
+        return;
+    }
+
+    lval *cur = (lval*)obj;
+    switch (cur->type) {
+        case LVAL_ERR:
+            free(cur->err);
             break;
         case LVAL_STR:
             free(cur->str);
             break;
-        default:
-            printf("ERROR HELP");
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            free(cur->cell);
+            break;
+        case LVAL_FUN:
+            if (cur->builtin == NULL && cur->code != NULL) lcode_free(cur->code);
             break;
     }
-    free(cur);
+    lval_free(cur);
 }
 
-void lenv_delete(lenv *cur) {
-    for (int i = 0;i < cur->count;i++) {
-        free(cur->syms[i]);
-        lval_delete(cur->vals[i]);
+long gc_minor_collect() {
+    for (int i = 0;i < gc_remembered_count;i++) {
+        gc_header *obj = gc_remembered[i];
+        obj->mark &= ~GC_REMEMBERED;
+        gc_trace(obj, gc_mark_young);
+    }
+    gc_remembered_count = 0;
+    for (int i = 0;i < gc_roots_count;i++) gc_mark_young(gc_roots[i]);
+    for (int i = 0;i < gc_stack_count;i++) gc_mark_young(gc_stack[i]);
+    // young objects the old-generation marker already reached may be
+    // referenced from black objects, so they have to survive too
+    if (gc_phase == GC_MARK) {
+        for (int i = 0;i < gc_young_count;i++) {
+            gc_header *obj = gc_young[i];
+            if ((obj->mark & GC_MARKED) == gc_black) gc_mark_young(obj);
+        }
+    }
+    while (gc_young_grey_count > 0)
+        gc_trace(gc_young_grey[--gc_young_grey_count], gc_mark_young);
+
+    long freed = 0;
+    for (int i = 0;i < gc_young_count;i++) {
+        gc_header *obj = gc_young[i];
+        if (obj->mark & GC_OLD) continue;
+        if (obj->mark & GC_SEEN) {
+            int color = gc_phase == GC_MARK ? obj->mark & GC_MARKED : gc_black;
+            obj->mark = (obj->mark & GC_HASHED) | color | GC_OLD;
+            gc_promoted_total++;
+            continue;
+        }
+        gc_finalize(obj);
+        freed++;
+    }
+
+    gc_minor_collections++;
+    gc_freed_total += freed;
+    gc_young_count = 0;
+    gc_young_bytes = 0;
+    return freed;
+}
+
+void gc_shade_roots() {
+    for (int i = 0;i < gc_roots_count;i++) gc_shade(gc_roots[i]);
+    for (int i = 0;i < gc_stack_count;i++) gc_shade(gc_stack[i]);
+}
+
+void gc_start_cycle() {
+    gc_black ^= GC_MARKED;
+    gc_phase = GC_MARK;
+    gc_shade_roots();
+}
+
+void gc_finish_sweep() {
+    gc_phase = GC_IDLE;
+    gc_collections++;
+    gc_freed_total += gc_sweep_freed;
+    gc_threshold = slab_live_bytes() * 2;
+    if (gc_threshold < GC_MIN_HEAP) gc_threshold = GC_MIN_HEAP;
+}
+
+// returns 1 if the slice ran out of time
+int gc_sweep_step(long deadline) {
+    int work = 0;
+    while (gc_sweep_class < SLAB_CLASSES) {
+        if (gc_sweep_page == NULL) {
+            gc_sweep_page = slab_classes[gc_sweep_class].pages;
+            gc_sweep_slot = gc_sweep_page ? (char*)gc_sweep_page + SLAB_PAGE_HEADER : NULL;
+        }
+        if (gc_sweep_page == NULL) {
+            gc_sweep_class++;
+            continue;
+        }
+        if (gc_sweep_slot >= gc_sweep_page->bump) {
+            gc_sweep_page = gc_sweep_page->next;
+            if (gc_sweep_page == NULL)
+                gc_sweep_class++;
+            else
+                gc_sweep_slot = (char*)gc_sweep_page + SLAB_PAGE_HEADER;
+            continue;
+        }
+
+        gc_header *obj = (gc_header*)gc_sweep_slot;
+        gc_sweep_slot += gc_sweep_page->size;
+        if (obj->type == LVAL_FREE || !(obj->mark & GC_OLD)) continue;
+        if ((obj->mark & GC_MARKED) == gc_black) continue;
+        // the remembered set still points at it, keep it for one more cycle
+        if (obj->mark & GC_REMEMBERED) {
+            obj->mark ^= GC_MARKED;
+            continue;
+        }
+        gc_finalize(obj);
+        gc_sweep_freed++;
+        if (++work % 256 == 0 && gc_now_us() >= deadline) return 1;
+    }
+    return 0;
+}
+
+void gc_step(long budget_us) {
+    long deadline = gc_now_us() + budget_us;
+    int work = 0;
+    while (gc_phase == GC_MARK) {
+        if (gc_grey_count == 0) {
+            // the root stack changes without a barrier, so marking is only
+            // over when a rescan of the roots finds nothing new
+            gc_shade_roots();
+            if (gc_grey_count == 0) {
+                gc_phase = GC_SWEEP;
+                gc_sweep_class = 0;
+                gc_sweep_page = NULL;
+                gc_sweep_freed = 0;
+                break;
+            }
+        }
+        gc_trace(gc_grey[--gc_grey_count], gc_shade);
+        if (++work % 256 == 0 && gc_now_us() >= deadline) return;
+    }
+    if (gc_phase == GC_SWEEP && !gc_sweep_step(deadline)) gc_finish_sweep();
+}
+
+void gc_record_pause(long us) {
+    int bucket = 0;
+    for (long limit = 10;bucket < GC_PAUSE_BUCKETS - 1 && us >= limit;limit *= 10) bucket++;
+    gc_pause_buckets[bucket]++;
+    gc_pause_count++;
+    gc_pause_total += us;
+    if (us > gc_pause_max) gc_pause_max = us;
+}
+
+// finishes the running cycle and then runs a complete one
+long gc_collect() {
+    long freed = gc_freed_total;
+    gc_minor_collect();
+    if (gc_phase != GC_IDLE) gc_step(LONG_MAX / 2);
+    gc_start_cycle();
+    gc_step(LONG_MAX / 2);
+    return gc_freed_total - freed;
+}
+
+// called between top-level forms; anything young that is still needed
+// is on the root stack, so the nursery can usually be dropped as a whole
+void gc_end_form() {
+    long start = gc_now_us();
+    int bulk = gc_phase != GC_MARK && gc_remembered_count == 0;
+    for (int i = 0;bulk && i < gc_stack_count;i++) {
+        void *obj = gc_stack[i];
+        if (obj == NULL || LVAL_IS_IMMEDIATE(obj)) continue;
+        if (!(((gc_header*)obj)->mark & GC_OLD)) bulk = 0;
+    }
+
+    if (!bulk) {
+        gc_minor_collect();
+    }
+    else {
+        long freed = 0;
+        for (int i = 0;i < gc_young_count;i++) {
+            gc_header *obj = gc_young[i];
+            if (obj->mark & GC_OLD) continue;
+            gc_finalize(obj);
+            freed++;
+        }
+        gc_freed_total += freed;
+        gc_young_count = 0;
+        gc_young_bytes = 0;
+        gc_arena_resets++;
+    }
+    gc_record_pause(gc_now_us() - start);
+}
+
+void gc_safe_point() {
+    if (gc_young_bytes < GC_NURSERY_SIZE && gc_phase == GC_IDLE) return;
+    long start = gc_now_us();
+    if (gc_young_bytes >= GC_NURSERY_SIZE) {
+        gc_minor_collect();
+        if (gc_phase == GC_IDLE && slab_live_bytes() >= gc_threshold) gc_start_cycle();
+    }
+    if (gc_phase != GC_IDLE) gc_step(gc_budget_us);
+    gc_record_pause(gc_now_us() - start);
+}
+
+// Nodes built by lval_read are never modified, so equal subtrees can share
+// one node. The table is weak: gc_finalize drops dead entries, and a node
+// found while the sweep is running is blackened before it can be freed.
+// Children are canonical already, so lists are compared by child pointers.
+typedef struct {
+    lval *val;
+    unsigned long hash;
+} hashcons_entry;
+
+#define HASHCONS_TOMBSTONE ((lval*)(uintptr_t)4)
+
+static int hashcons_enabled = 1;
+static hashcons_entry *hashcons_table;
+static long hashcons_cap;
+static long hashcons_count;
+static long hashcons_used;
+static long hashcons_lookups;
+static long hashcons_hits;
+
+unsigned long lval_hash(lval *cur) {
+    unsigned long h = cur->type * 0x9e3779b97f4a7c15UL;
+    switch (cur->type) {
+        case LVAL_NUM:
+            return h ^ (unsigned long)cur->num;
+        case LVAL_SYM:
+            return h ^ cur->sym->hash;
+        case LVAL_STR:
+            return h ^ lval_hash_str(cur->str);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0;i < cur->count;i++) h = (h ^ (uintptr_t)cur->cell[i]) * 1099511628211UL;
+            return h;
+    }
+    return h;
+}
+
+int lval_same_node(lval *x, lval *y) {
+    if (x->type != y->type) return 0;
+    switch (x->type) {
+        case LVAL_NUM:
+            return x->num == y->num;
+        case LVAL_SYM:
+            return x->sym == y->sym;
+        case LVAL_STR:
+            return strcmp(x->str, y->str) == 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return x->count == y->count
+                && (x->count == 0 || memcmp(x->cell, y->cell, sizeof(lval*) * x->count) == 0);
+    }
+    return 0;
+}
+
+void hashcons_grow() {
+    hashcons_entry *old = hashcons_table;
+    long old_cap = hashcons_cap;
+    // only grow when live entries fill the table, otherwise just drop tombstones
+    if (hashcons_count * 2 >= hashcons_cap) hashcons_cap = hashcons_cap ? hashcons_cap * 2 : 1024;
+    hashcons_table = calloc(hashcons_cap, sizeof(hashcons_entry));
+    hashcons_used = hashcons_count;
+    for (long i = 0;i < old_cap;i++) {
+        if (old[i].val == NULL || old[i].val == HASHCONS_TOMBSTONE) continue;
+        long j = old[i].hash & (hashcons_cap - 1);
+        while (hashcons_table[j].val != NULL) j = (j + 1) & (hashcons_cap - 1);
+        hashcons_table[j] = old[i];
+    }
+    free(old);
+}
+
+void hashcons_remove(lval *cur) {
+    unsigned long hash = lval_hash(cur);
+    for (long i = hash & (hashcons_cap - 1);hashcons_table[i].val != NULL;i = (i + 1) & (hashcons_cap - 1)) {
+        if (hashcons_table[i].val == cur) {
+            hashcons_table[i].val = HASHCONS_TOMBSTONE;
+            hashcons_count--;
+            return;
+        }
+    }
+}
+
+// an old node that is still white during the sweep is garbage the sweep has
+// not reached yet; blacken it and its subtree so it survives being reused
+void hashcons_revive(lval *cur) {
+    if (LVAL_IS_IMMEDIATE(cur) || !(cur->mark & GC_OLD)) return;
+    if ((cur->mark & GC_MARKED) == gc_black) return;
+    cur->mark ^= GC_MARKED;
+    if (cur->type == LVAL_SEXPR || cur->type == LVAL_QEXPR)
+        for (int i = 0;i < cur->count;i++) hashcons_revive(cur->cell[i]);
+}
+
+lval *lval_hashcons(lval *cur) {
+    if (!hashcons_enabled || LVAL_IS_IMMEDIATE(cur) || LVAL_TYPE(cur) == LVAL_ERR) return cur;
+    hashcons_lookups++;
+    if ((hashcons_used + 1) * 4 >= hashcons_cap * 3) hashcons_grow();
+
+    unsigned long hash = lval_hash(cur);
+    long i = hash & (hashcons_cap - 1);
+    for (;hashcons_table[i].val != NULL;i = (i + 1) & (hashcons_cap - 1)) {
+        lval *other = hashcons_table[i].val;
+        if (other == HASHCONS_TOMBSTONE || hashcons_table[i].hash != hash) continue;
+        if (lval_same_node(other, cur)) {
+            hashcons_hits++;
+            if (gc_phase == GC_SWEEP) hashcons_revive(other);
+            return other;
+        }
     }
-    free(cur->syms);
-    free(cur->vals);
-    free(cur);
+    hashcons_table[i].val = cur;
+    hashcons_table[i].hash = hash;
+    hashcons_count++;
+    hashcons_used++;
+    cur->mark |= GC_HASHED;
+    return cur;
 }
 
 lval *lval_add(lval *x, lval *add) {
@@ -243,36 +1187,156 @@ lval *lval_add(lval *x, lval *add) {
     x->count++;
     x->cell = realloc(x->cell, sizeof(lval*) * x->count);
     x->cell[x->count - 1] = add;
+    gc_write_barrier(x, add);
     return x;
 }
 
+int lenv_find(lenv *env, lsym *sym) {
+    if (env->index == NULL) {
+        for (int i = 0;i < env->count;i++)
+            if (env->syms[i] == sym) return i;
+        return -1;
+    }
+    int mask = env->index_cap - 1;
+    for (int i = sym->hash & mask;env->index[i] != 0;i = (i + 1) & mask)
+        if (env->syms[env->index[i] - 1] == sym) return env->index[i] - 1;
+    return -1;
+}
+
+void lenv_index_insert(lenv *env, int entry) {
+    int mask = env->index_cap - 1;
+    int i = env->syms[entry]->hash & mask;
+    while (env->index[i] != 0) i = (i + 1) & mask;
+    env->index[i] = entry + 1;
+}
+
+void lenv_reindex(lenv *env) {
+    free(env->index);
+    env->index_cap = 16;
+    while (env->index_cap < env->count * 2) env->index_cap *= 2;
+    env->index = calloc(env->index_cap, sizeof(int));
+    for (int i = 0;i < env->count;i++) lenv_index_insert(env, i);
+}
+
+// gives env arrays of its own before it changes them
+void lenv_unshare(lenv *env) {
+    if (env->shared == NULL) return;
+    if (--*env->shared == 0) {
+        free(env->shared);
+        env->shared = NULL;
+        return;
+    }
+    env->shared = NULL;
+
+    lsym **syms = malloc(sizeof(lsym*) * env->cap);
+    lval **vals = malloc(sizeof(lval*) * env->cap);
+    memcpy(syms, env->syms, sizeof(lsym*) * env->count);
+    memcpy(vals, env->vals, sizeof(lval*) * env->count);
+    env->syms = syms;
+    env->vals = vals;
+    if (env->index != NULL) {
+        int *index = malloc(sizeof(int) * env->index_cap);
+        memcpy(index, env->index, sizeof(int) * env->index_cap);
+        env->index = index;
+    }
+}
+
+// makes room for at least cap entries
+void lenv_reserve(lenv *env, int cap) {
+    if (cap <= env->cap) return;
+    if (env->syms == env->inline_syms) {
+        env->syms = malloc(sizeof(lsym*) * cap);
+        env->vals = malloc(sizeof(lval*) * cap);
+        memcpy(env->syms, env->inline_syms, sizeof(lsym*) * env->count);
+        memcpy(env->vals, env->inline_vals, sizeof(lval*) * env->count);
+    }
+    else {
+        env->syms = realloc(env->syms, sizeof(lsym*) * cap);
+        env->vals = realloc(env->vals, sizeof(lval*) * cap);
+    }
+    env->cap = cap;
+}
+
 lval *lenv_get(lenv *env, lval *cur) {
-    for (int i = 0;i < env->count;i++) {
-        if (strcmp(cur->sym, env->syms[i]) == 0) {
-            return lval_copy(env->vals[i]);
-        }
+    for (;env != NULL;env = env->par) {
+        int i = lenv_find(env, cur->sym);
+        if (i >= 0) return env->vals[i];
     }
-    if (env->par == NULL)
-        return lval_make_error("unbound symbol '%s'", cur->sym);
-    else
-        return lenv_get(env->par, cur);
+    return lval_make_error("unbound symbol '%v'", cur);
 }
 
-void lenv_put(lenv *env, lval *cur_name, lval *cur_fun) {
-    for (int i = 0;i < env->count;i++) {
-        if (strcmp(env->syms[i], cur_name->sym) == 0) {
-            lval_delete(env->vals[i]);
-            env->vals[i] = lval_copy(cur_fun);
-        }
+// bumped whenever a new name appears in a non-global environment after
+// its call bound it, as that name may shadow a resolved symbol
+static long lenv_shadow_epoch;
+
+// the same for constants, which only a local binding of the same name
+// or a restored global environment can hide
+static long lenv_const_epoch;
+
+// only global bindings can be constant
+int lenv_is_constant(lenv *env, lsym *sym) {
+    return env->par == NULL && sym->constant;
+}
+
+// The global environment only drops bindings in lenv_restore, so a name
+// that has never been bound anywhere else keeps resolving to the same
+// global slot. Symbol nodes cache that slot; lenv_global_version moves on
+// whenever a name is first bound locally or the environment is restored,
+// the only ways a cached slot goes stale.
+static lenv *lenv_global;
+static long lenv_global_version;
+static long ic_hits;
+static long ic_misses;
+
+lval *lenv_get_global(lenv *env, lval *cur) {
+    if (cur->gversion == lenv_global_version) {
+        ic_hits++;
+        return lenv_global->vals[cur->gslot];
+    }
+    ic_misses++;
+    if (cur->sym->local) return lenv_get(env, cur);
+    int i = lenv_find(lenv_global, cur->sym);
+    if (i < 0) return lval_make_error("unbound symbol '%v'", cur);
+    cur->gslot = i;
+    cur->gversion = lenv_global_version;
+    return lenv_global->vals[i];
+}
+
+void lsym_mark_local(lsym *sym) {
+    if (sym->local) return;
+    sym->local = 1;
+    lenv_global_version++;
+}
+
+// replaces the binding of sym or adds one; returns 1 if it was added
+int lenv_bind(lenv *env, lsym *sym, lval *val) {
+    if (env->par != NULL) lsym_mark_local(sym);
+    lenv_unshare(env);
+    int i = lenv_find(env, sym);
+    if (i >= 0) {
+        env->vals[i] = val;
+        gc_write_barrier_env(env, val);
+        return 0;
     }
 
+    if (env->count == env->cap) lenv_reserve(env, env->cap * 2);
+    env->syms[env->count] = sym;
+    env->vals[env->count] = val;
     env->count++;
-    env->syms = realloc(env->syms, env->count * sizeof(char*));
-    env->vals = realloc(env->vals, env->count * sizeof(lval*));
+    gc_write_barrier_env(env, val);
+
+    if (env->index != NULL && env->count * 2 <= env->index_cap)
+        lenv_index_insert(env, env->count - 1);
+    else if (env->count > LENV_INDEX_MIN)
+        lenv_reindex(env);
+    return 1;
+}
 
-    env->syms[env->count - 1] = malloc(strlen(cur_name->sym) + 1);
-    strcpy(env->syms[env->count - 1], cur_name->sym);
-    env->vals[env->count - 1] = lval_copy(cur_fun);
+void lenv_put(lenv *env, lval *cur_name, lval *cur_fun) {
+    if (lenv_bind(env, cur_name->sym, cur_fun) && env->par != NULL) {
+        lenv_shadow_epoch++;
+        if (cur_name->sym->constant) lenv_const_epoch++;
+    }
     //return env;///!!!!!!!!!!!
 }
 
@@ -291,7 +1355,7 @@ lval *lval_read(mpc_ast_t *cur) {
     if (strstr(cur->tag, "number")) {
         errno = 0;
         long cur_val = strtol(cur->contents, NULL, 10);
-        return (errno == 0 ? lval_make_num(cur_val) : lval_make_error("Error: bad NUMBER %s", cur->contents));
+        return (errno == 0 ? lval_make_num(cur_val) : lval_make_error("Error: bad NUMBER %v", lval_make_sym(cur->contents)));
     }
     if (strstr(cur->tag, "symbol")) {
         return lval_make_sym(cur->contents);
@@ -311,66 +1375,105 @@ lval *lval_read(mpc_ast_t *cur) {
         if (strcmp(cur->children[i]->contents, "}") == 0) continue;
         if (strcmp(cur->children[i]->tag, "regex") == 0) continue;
         if (strstr(cur->children[i]->tag, "comment")) continue;
-        x = lval_add(x, lval_read(cur->children[i]));
+        x = lval_add(x, lval_hashcons(lval_read(cur->children[i])));
     }
     return x;
 }
 
-lval *lval_call(lenv *env, lval *fun, lval *a) {
-    if (fun->builtin != NULL) return fun->builtin(env, a);
+// fun applied to the first bound arguments in a, still waiting for the rest
+lval *lval_make_partial(lval *fun, lval *a, int bound) {
+    lval *rest = lval_make_q_expr();
+    rest->count = fun->formals->count - bound;
+    rest->cell = malloc(sizeof(lval*) * rest->count);
+    memcpy(rest->cell, fun->formals->cell + bound, sizeof(lval*) * rest->count);
+    lval *ans = lval_make_lambda(rest, fun->body);
+    ans->arity = -1;
+    ans->target = fun;
+    ans->bound = a;
+    gc_write_barrier(ans, fun);
+    gc_write_barrier(ans, a);
+    return ans;
+}
 
-    // for (int i = 0;i < a->count;i++)
-    //     lenv_put(fun->env, fun->formals->cell[i], a->cell[i]);
-    
-    // lval_delete(a);
-    // fun->env->par = env;
-    // return lval_eval_builtin(fun->env, lval_add(lval_make_s_expr(), fun->body));
-    int arguments_count = a->count;
-    int formals_count = fun->formals->count;
-    while (a->count > 0) {
-        if (fun->formals->count == 0) {
-            lval_delete(a);
-            return lval_make_error("Function passed too many arguments. Got %i, Expected %i.", arguments_count, formals_count);
-        }
-        
-        lval *cur_formal = lval_pop(fun->formals, 0);
-        if (strcmp(cur_formal->sym, "&") == 0) {
-            if (fun->formals->count != 1) {
-                lval_delete(a);
+// Binds the arguments a of a call to *fun. A call that needs no body run,
+// a builtin, an error or a partial application, returns its result;
+// otherwise the result is NULL, with *fun and *frame set to the lambda
+// whose body is left to run and its frame, so callers can run the body
+// in place of their own frame when the call is in tail position.
+lval *lval_call_prepare(lenv *env, lval **callee, lval *a, lenv **frame_out) {
+    lval *fun = *callee;
+    if (fun->builtin != NULL) return lval_call_builtin(env, fun, a);
+
+    // a partial application is the original function called with the
+    // arguments gathered so far followed by the new ones
+    if (fun->target != NULL) {
+        if (fun->target->arity >= 0 && a->count > fun->formals->count)
+            return lval_make_error("Function passed too many arguments. Got %i, Expected %i.", a->count, fun->formals->count);
+        lval *all = lval_alloc(LVAL_SEXPR);
+        all->count = fun->bound->count + a->count;
+        all->cell = malloc(sizeof(lval*) * all->count);
+        memcpy(all->cell, fun->bound->cell, sizeof(lval*) * fun->bound->count);
+        memcpy(all->cell + fun->bound->count, a->cell, sizeof(lval*) * a->count);
+        gc_push(all);
+        *callee = fun->target;
+        return lval_call_prepare(env, callee, all, frame_out);
+    }
+
+    if (fun->arity > a->count) return lval_make_partial(fun, a, a->count);
+
+    lenv *frame;
+    if (fun->arity == a->count) {
+        frame = lenv_make_frame(fun);
+        for (int i = 0;i < a->count;i++) {
+            frame->vals[i] = a->cell[i];
+            gc_write_barrier_env(frame, a->cell[i]);
+        }
+        frame->count = a->count;
+        if (frame->count > LENV_INDEX_MIN) lenv_reindex(frame);
+        *frame_out = frame;
+        return NULL;
+    }
+
+    // fun is shared, so arguments are bound into a fresh frame instead of
+    // being popped off fun's own formals
+    lval *formals = fun->formals;
+    frame = lenv_make();
+    frame->par = fun->env;
+    int bound = 0;
+    for (int i = 0;i < a->count;i++) {
+        if (bound == formals->count)
+            return lval_make_error("Function passed too many arguments. Got %i, Expected %i.", a->count, formals->count);
+
+        lval *cur_formal = formals->cell[bound++];
+        if (cur_formal->sym == lsym_varargs) {
+            if (formals->count - bound != 1)
                 return lval_make_error("Symbol '&' not followed by single symbol");
-            }
 
-            lval *list_name = lval_pop(fun->formals, 0);
-            lenv_put(fun->env, list_name, lval_list_builtin(env, a));
-            lval_delete(cur_formal);
-            lval_delete(list_name);
+            lval *rest = lval_make_q_expr();
+            for (int j = i;j < a->count;j++) lval_add(rest, a->cell[j]);
+            lenv_bind(frame, formals->cell[bound++]->sym, rest);
             break;
         }
-        lval *cur_val = lval_pop(a, 0);
-
-        lenv_put(fun->env, cur_formal, cur_val);
-        lval_delete(cur_formal);
-        lval_delete(cur_val);
+        lenv_bind(frame, cur_formal->sym, a->cell[i]);
     }
-    if (fun->formals->count > 0 && strcmp(fun->formals->cell[0]->sym, "&") == 0) {
-        if (fun->formals->count != 2) {
-            lval_delete(a);
+    if (bound < formals->count && formals->cell[bound]->sym == lsym_varargs) {
+        if (formals->count - bound != 2)
             return lval_make_error("Symbol '&' not followed by single symbol");
-        }
-        lval_delete(lval_pop(fun->formals, 0));
-        lval *list_name = lval_pop(fun->formals, 0);
-        lval *val = lval_make_q_expr();
-        lenv_put(fun->env, list_name, val);
-        lval_delete(list_name);
-        lval_delete(val);
-    }
-    lval_delete(a);
-    if (fun->formals->count == 0) {
-        fun->env->par = env;
-        return lval_eval_builtin(fun->env, lval_add(lval_make_s_expr(), lval_copy(fun->body)));
+        lenv_bind(frame, formals->cell[bound + 1]->sym, lval_make_q_expr());
+        bound += 2;
     }
-    else
-        return lval_copy(fun);
+
+    if (bound == formals->count) {
+        *frame_out = frame;
+        return NULL;
+    }
+    return lval_make_partial(fun, a, bound);
+}
+
+lval *lval_call(lenv *env, lval *fun, lval *a) {
+    lenv *frame;
+    lval *ans = lval_call_prepare(env, &fun, a, &frame);
+    return ans != NULL ? ans : lval_run(frame, fun);
 }
 
 
@@ -395,13 +1498,13 @@ void lval_print_str(lval *cur) {
 
 void lval_print(lval *cur) {
     // printf("print type %s\n", ltype_name(cur->type));
-    switch (cur->type) {
+    switch (LVAL_TYPE(cur)) {
         case LVAL_BOOL:
         case LVAL_NUM:
-            printf("%ld", cur->num);
+            printf("%ld", LVAL_GET_NUM(cur));
             break;
         case LVAL_SYM:
-            printf("%s", cur->sym);
+            printf("%s", cur->sym->name);
             break;
         case LVAL_FUN:
             if (cur->builtin != NULL)
@@ -413,7 +1516,7 @@ void lval_print(lval *cur) {
             }
             break;
         case LVAL_ERR:
-            printf("ERROR:%s", cur->err);
+            printf("ERROR:%s", lval_error_message(cur));
             break;
         case LVAL_SEXPR:
             lval_print_expr(cur, "(", ")");
@@ -427,17 +1530,71 @@ void lval_print(lval *cur) {
     }
 }
 
+// makes env hold the same bindings as cur, sharing cur's arrays unless
+// they are the inline ones
+void lenv_share(lenv *env, lenv *cur) {
+    env->count = cur->count;
+    if (cur->syms == cur->inline_syms) {
+        env->cap = LENV_INLINE;
+        env->syms = env->inline_syms;
+        env->vals = env->inline_vals;
+        memcpy(env->syms, cur->syms, sizeof(lsym*) * cur->count);
+        memcpy(env->vals, cur->vals, sizeof(lval*) * cur->count);
+        env->index = NULL;
+        env->index_cap = 0;
+        env->shared = NULL;
+        return;
+    }
+
+    if (cur->shared == NULL) {
+        cur->shared = malloc(sizeof(int));
+        *cur->shared = 1;
+    }
+    (*cur->shared)++;
+    env->shared = cur->shared;
+    env->cap = cur->cap;
+    env->syms = cur->syms;
+    env->vals = cur->vals;
+    env->index = cur->index;
+    env->index_cap = cur->index_cap;
+}
+
+// copies are copy-on-write, so taking one costs the same for any size
 lenv *lenv_copy(lenv *cur) {
-    lenv *ans = malloc(sizeof(lenv));
+    lenv *ans = lenv_make();
     ans->par = cur->par;
-    ans->count = cur->count;
-    ans->syms = malloc(sizeof(char*) * ans->count);
-    ans->vals = malloc(sizeof(lval*) * ans->count);
-    for (int i = 0;i < cur->count;i++) {
-        ans->syms[i] = malloc(strlen(cur->syms[i]) + 1);
-        strcpy(ans->syms[i], cur->syms[i]);
+    lenv_share(ans, cur);
+    return ans;
+}
 
-        ans->vals[i] = lval_copy(cur->vals[i]);
+// puts env back to the bindings of snap, an earlier lenv_copy of it
+void lenv_restore(lenv *env, lenv *snap) {
+    // constants are only ever added, so the ones made since snap go away
+    if (env->par == NULL)
+        for (int i = snap->count;i < env->count;i++) env->syms[i]->constant = 0;
+    lenv_release(env);
+    lenv_share(env, snap);
+
+    // names may have disappeared or moved, so cached and resolved
+    // references to env have to look again
+    lenv_global_version++;
+    lenv_const_epoch++;
+    if (env->par != NULL) lenv_shadow_epoch++;
+
+    // env may already be black, or old while snap is still young
+    if (gc_phase == GC_MARK || ((env->mark & GC_OLD) && !(snap->mark & GC_OLD)))
+        for (int i = 0;i < env->count;i++) gc_write_barrier_env(env, env->vals[i]);
+}
+
+// an empty frame for a full call of fun, with room for every argument and
+// the formals already in place
+lenv *lenv_make_frame(lval *fun) {
+    lenv *ans = lenv_make();
+    ans->par = fun->env;
+    lenv_reserve(ans, fun->arity);
+    for (int i = 0;i < fun->arity;i++) {
+        ans->syms[i] = fun->formals->cell[i]->sym;
+        lsym_mark_local(ans->syms[i]);
     }
     return ans;
 }
@@ -449,96 +1606,38 @@ void lenv_def(lenv *env, lval *name, lval *fun) {
     lenv_put(env, name, fun);
 }
 
-lval *lval_copy(lval *cur) {
-    lval *ans = malloc(sizeof(lval));
-    ans->type = cur->type;
-    switch (cur->type)
-    {
-        case LVAL_BOOL:
-        case LVAL_NUM:
-            ans->num = cur->num;
-            break;
-        case LVAL_SYM:
-            ans->sym = malloc(strlen(cur->sym) + 1);
-            strcpy(ans->sym, cur->sym);
-            break;
-        case LVAL_FUN:
-            if (cur->builtin != NULL)
-                ans->builtin = cur->builtin;
-            else {
-                ans->builtin = NULL;
-                ans->env = lenv_copy(cur->env);
-                ans->formals = lval_copy(cur->formals);
-                ans->body = lval_copy(cur->body);
-            }
-            break;
-        case LVAL_ERR:
-            ans->err = malloc(strlen(cur->err) + 1);
-            strcpy(ans->err, cur->err);
-            break;
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            ans->count = cur->count;
-            ans->cell = malloc(sizeof(lval*) * ans->count);
-            for (int i = 0;i < ans->count;i++) ans->cell[i] = lval_copy(cur->cell[i]);
-            break;
-        case LVAL_STR:
-            ans->str = malloc(strlen(cur->str) + 1);
-            strcpy(ans->str, cur->str);
-            break;
-        default:
-            break;
-    }
-    return ans;
-}
-
 lval *lval_pop(lval *cur, int ind) {
     lval *ans = cur->cell[ind];
     memmove(&cur->cell[ind], &cur->cell[ind + 1], sizeof(lval*) * (cur->count - ind - 1));
     cur->count--;
-
-    cur->cell = realloc(cur->cell, sizeof(lval*) * cur->count);
-    return ans;
-}
-
-lval *lval_take(lval *cur, int ind) {
-    lval *ans = lval_pop(cur, ind);
-    lval_delete(cur);
     return ans;
 }
 
-lval *lval_eval_op(lval *f, lval *s, char *op) {
-    if (strcmp(op, "+") == 0) return lval_make_num(f->num + s->num);
-    if (strcmp(op, "-") == 0) return lval_make_num(f->num - s->num);
-    if (strcmp(op, "*") == 0) return lval_make_num(f->num * s->num);
-    if (strcmp(op, "/") == 0) 
-        return (s->num != 0 ? lval_make_num(f->num / s->num) : lval_make_error("ERROR: DIVISION by ZERO"));
-    return lval_make_error("ERROR: INVALID OPERATOR %s", op);
+lval *lval_eval_op(lval *f, lval *s, int op) {
+    switch (op) {
+        case LOP_ADD: return lval_make_num(LVAL_GET_NUM(f) + LVAL_GET_NUM(s));
+        case LOP_SUB: return lval_make_num(LVAL_GET_NUM(f) - LVAL_GET_NUM(s));
+        case LOP_MUL: return lval_make_num(LVAL_GET_NUM(f) * LVAL_GET_NUM(s));
+        case LOP_DIV:
+            return (LVAL_GET_NUM(s) != 0 ? lval_make_num(LVAL_GET_NUM(f) / LVAL_GET_NUM(s)) : lval_make_error("ERROR: DIVISION by ZERO"));
+    }
+    return lval_make_error("ERROR: INVALID OPERATOR %i", op);
 }
 
-lval *lval_op_builtin(lenv *env, lval *cur, char *sym) {
+lval *lval_op_builtin(lenv *env, lval *cur, int op) {
     for (int i = 0;i < cur->count;i++) {
-        if (cur->cell[i]->type != LVAL_NUM) {
-            lval_delete(cur);
+        if (LVAL_TYPE(cur->cell[i]) != LVAL_NUM)
             return lval_make_error("ERROR: INVALID NUMBER");
-        }
     }
 
     lval *first = lval_pop(cur, 0);
-    if (cur->count == 0 && strcmp(sym, "-") == 0) 
-        first->num *= -1;
+    if (cur->count == 0 && op == LOP_SUB)
+        first = lval_make_num(-LVAL_GET_NUM(first));
 
-    if (cur->count == 0) {
-        lval_delete(cur);
-        return first;
-    }
-    
     while (cur->count > 0) {
-        lval *current_el = lval_pop(cur, 0);
-        first = lval_eval_op(first, current_el, sym);
-        lval_delete(current_el);
+        first = lval_eval_op(first, lval_pop(cur, 0), op);
+        if (LVAL_TYPE(first) == LVAL_ERR) break;
     }
-    lval_delete(cur);
     return first;
 }
 
@@ -557,81 +1656,161 @@ char* ltype_name(int t) {
 
 lval *lval_head_builtin(lenv *env, lval *cur) {
     LASSERT(cur, cur->count == 1, "ERROR: cant take head of many q-expressions. Got %i, Expected %i.", cur->count, 1)
-    LASSERT(cur, cur->cell[0]->type == LVAL_QEXPR, "ERROR: cant take head of not q-expression. Got %s, Expected %s.", ltype_name(cur->cell[0]->type), ltype_name(LVAL_QEXPR))
+    LASSERT(cur, LVAL_TYPE(cur->cell[0]) == LVAL_QEXPR, "ERROR: cant take head of not q-expression. Got %s, Expected %s.", ltype_name(LVAL_TYPE(cur->cell[0])), ltype_name(LVAL_QEXPR))
     LASSERT(cur, cur->cell[0]->count != 0, "ERROR: size of q-expression is zero")
 
-    lval *child = lval_take(cur, 0);
-    while (child->count > 1) {
-        lval_delete(lval_pop(child, 1));
-    }
-    return child;
+    return lval_add(lval_make_q_expr(), cur->cell[0]->cell[0]);
 }
 
 lval *lval_tail_builtin(lenv *env, lval *cur) {
     LASSERT(cur, cur->count == 1, "ERROR: cant take head of many q-expressions")
-    LASSERT(cur, cur->cell[0]->type == LVAL_QEXPR, "ERROR: cant take head of not q-expression")
+    LASSERT(cur, LVAL_TYPE(cur->cell[0]) == LVAL_QEXPR, "ERROR: cant take head of not q-expression")
     LASSERT(cur, cur->cell[0]->count != 0, "ERROR: size of q-expression is zero")
 
-    lval *child = lval_take(cur, 0);
-    lval_delete(lval_pop(child, 0));
-    return child;
+    lval *child = cur->cell[0];
+    lval *ans = lval_make_q_expr();
+    ans->count = child->count - 1;
+    ans->cell = malloc(sizeof(lval*) * ans->count);
+    memcpy(ans->cell, child->cell + 1, sizeof(lval*) * ans->count);
+    return ans;
 }
 
 lval *lval_list_builtin(lenv *env, lval *cur) {
     LASSERT(cur, cur->count > 0, "ERROR: list size is zero")
     
-    lval *ans = lval_make_q_expr();
-    while (cur->count > 0) {
-        lval_add(ans, lval_pop(cur, 0));
-    }
-    lval_delete(cur);
-    return ans;
+    cur->type = LVAL_QEXPR;
+    return cur;
 }
 
 void lval_join_child(lval *cur, lval *child) {
-    while (child->count > 0) {
-        lval_add(cur, lval_pop(child, 0));
-    }
-    lval_delete(child);
+    if (child->count == 0) return;
+    cur->cell = realloc(cur->cell, sizeof(lval*) * (cur->count + child->count));
+    memcpy(cur->cell + cur->count, child->cell, sizeof(lval*) * child->count);
+    cur->count += child->count;
+    gc_remember(cur);
 }
 
 lval *lval_join_builtin(lenv *env, lval *cur) {
     LASSERT(cur, cur->count > 0, "ERROR: cant join nothing")
     for (int i = 0;i < cur->count;i++)
-        LASSERT(cur, cur->cell[i]->type == LVAL_QEXPR, "ERROR: cant join not Q-expression")
+        LASSERT(cur, LVAL_TYPE(cur->cell[i]) == LVAL_QEXPR, "ERROR: cant join not Q-expression")
     lval *ans = lval_make_q_expr();
-    while (cur->count > 0) {
-        lval_join_child(ans, lval_pop(cur, 0));
-    }
-    lval_delete(cur);
+    for (int i = 0;i < cur->count;i++)
+        lval_join_child(ans, cur->cell[i]);
     return ans;
 }
 
 lval *lval_eval_builtin(lenv *env, lval *cur) {
     LASSERT(cur, cur->count == 1, "ERROR: can eval only 1 Q-expression")
-    LASSERT(cur, cur->cell[0]->type == LVAL_QEXPR, "ERROR: eval not Q-expression")
-    lval *child = lval_take(cur, 0);
-    child->type = LVAL_SEXPR;
+    LASSERT(cur, LVAL_TYPE(cur->cell[0]) == LVAL_QEXPR, "ERROR: eval not Q-expression")
     // lval_print(cur);
-    return lval_eval(env, child);
+    return lval_eval_s_expression(env, cur->cell[0]);
 }
 
-lval *lval_lambda_builtin(lenv *env, lval *cur) {
-    LASSERT_NUM("\\", cur, 2);
-    LASSERT_TYPE("\\", cur, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", cur, 1, LVAL_QEXPR);
+// slot the formal gets in the call frame, lval_call binds them in order
+// and '&' takes no slot of its own
+int lval_formal_slot(lval *formals, lsym *sym) {
+    int slot = 0;
+    for (int i = 0;i < formals->count;i++) {
+        if (formals->cell[i]->sym == lsym_varargs) continue;
+        if (formals->cell[i]->sym == sym) return slot;
+        slot++;
+    }
+    return -1;
+}
+
+lval *lval_make_hint(lval *cur, int depth, int slot, lenv *scope) {
+    if (cur->slot == slot && cur->depth == depth
+        && cur->scope == scope && cur->epoch == lenv_shadow_epoch)
+        return cur;
+    lval *ans = lval_alloc(LVAL_SYM);
+    ans->sym = cur->sym;
+    ans->depth = depth;
+    ans->slot = slot;
+    ans->scope = scope;
+    ans->epoch = lenv_shadow_epoch;
+    ans->gversion = -1;
+    ans->gslot = -1;
+    return ans;
+}
+
+lval *lval_make_const_hint(lval *cur, lval *val) {
+    if (cur->depth < 0 && cur->constant == val && cur->epoch == lenv_const_epoch)
+        return cur;
+    lval *ans = lval_alloc(LVAL_SYM);
+    ans->sym = cur->sym;
+    ans->depth = -1;
+    ans->slot = -1;
+    ans->constant = val;
+    ans->epoch = lenv_const_epoch;
+    ans->gversion = -1;
+    ans->gslot = -1;
+    return ans;
+}
+
+// Copies body with every symbol resolved to where it will be found when
+// the closure runs: formals to their slot in the call frame, other names
+// to the frame of the defining environment scope that binds them now, and
+// global constants to their value. Names nobody binds yet stay
+// unresolved. Subtrees without resolved symbols are shared with the
+// original body.
+lval *lval_resolve(lval *cur, lval *formals, lenv *scope) {
+    if (LVAL_IS_IMMEDIATE(cur)) return cur;
+    if (cur->type == LVAL_SYM) {
+        int slot = lval_formal_slot(formals, cur->sym);
+        if (slot >= 0) return lval_make_hint(cur, 0, slot, NULL);
+        int depth = 1;
+        for (lenv *e = scope;e != NULL;e = e->par, depth++) {
+            slot = lenv_find(e, cur->sym);
+            if (slot >= 0 && lenv_is_constant(e, cur->sym)) return lval_make_const_hint(cur, e->vals[slot]);
+            if (slot >= 0) return lval_make_hint(cur, depth, slot, scope);
+        }
+        return cur;
+    }
+    if (cur->type != LVAL_SEXPR && cur->type != LVAL_QEXPR) return cur;
+
+    lval *ans = NULL;
+    for (int i = 0;i < cur->count;i++) {
+        lval *child = lval_resolve(cur->cell[i], formals, scope);
+        if (child != cur->cell[i] && ans == NULL) {
+            ans = lval_alloc(cur->type);
+            ans->count = cur->count;
+            ans->cell = malloc(sizeof(lval*) * cur->count);
+            memcpy(ans->cell, cur->cell, sizeof(lval*) * cur->count);
+        }
+        if (ans != NULL) ans->cell[i] = child;
+    }
+    return ans != NULL ? ans : cur;
+}
+
+// --no-vm leaves every lambda on the tree-walking evaluator
+static int vm_enabled = 1;
+
+// closures keep the environment they were made in as their lexical parent
+lval *lval_make_closure(lenv *env, lval *formals, lval *body) {
+    lval *ans = lval_make_lambda(formals, body);
+    ans->env = env;
+    return ans;
+}
+
+void lval_resolve_closure(lval *fun) {
+    for (int i = 0;i < fun->formals->count;i++)
+        if (LVAL_TYPE(fun->formals->cell[i]) != LVAL_SYM) return;
+    fun->body = lval_resolve(fun->body, fun->formals, fun->env);
+    gc_write_barrier(fun, fun->body);
+    if (vm_enabled) fun->code = lval_compile(fun->body);
+}
 
+lval *lval_lambda_builtin(lenv *env, lval *cur) {
     for (int i = 0;i < cur->cell[0]->count;i++) {
-        LASSERT(cur, (cur->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(cur, (LVAL_TYPE(cur->cell[0]->cell[i]) == LVAL_SYM),
         "Cannot define non-symbol. Got %s, Expected %s.",
-        ltype_name(cur->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+        ltype_name(LVAL_TYPE(cur->cell[0]->cell[i])),ltype_name(LVAL_SYM));
     }
 
-    lval *formals = lval_pop(cur, 0);
-    lval *body = lval_pop(cur, 0);
-    lval_delete(cur);
-
-    return lval_make_lambda(formals, body);
+    lval *ans = lval_make_closure(env, cur->cell[0], cur->cell[1]);
+    lval_resolve_closure(ans);
+    return ans;
 }
 
 int lval_check_is_builtin_function(char *s) {
@@ -676,11 +1855,20 @@ lval *lval_var_builtin(lenv *env, lval *cur, char *func) {
     
     lval* syms = cur->cell[0];
     for (int i = 0; i < syms->count; i++)
-        LASSERT(cur, (syms->cell[i]->type == LVAL_SYM), "Function '%s' cannot define non-symbol. Got %s, Expected %s.", func,  ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+        LASSERT(cur, (LVAL_TYPE(syms->cell[i]) == LVAL_SYM), "Function '%s' cannot define non-symbol. Got %s, Expected %s.", func,  ltype_name(LVAL_TYPE(syms->cell[i])), ltype_name(LVAL_SYM));
     
     
     LASSERT(cur, (syms->count == cur->count-1), "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.", func, syms->count, cur->count-1);
-        
+
+    lenv *target = env;
+    if (strcmp(func, "=") != 0)
+        while (target->par != NULL) target = target->par;
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(cur, !lenv_is_constant(target, syms->cell[i]->sym), "Cannot redefine constant '%v'.", syms->cell[i]);
+        if (strcmp(func, "defconst") == 0)
+            LASSERT(cur, lenv_find(target, syms->cell[i]->sym) < 0, "Function 'defconst' cannot make existing symbol '%v' constant.", syms->cell[i]);
+    }
+
     for (int i = 0; i < syms->count; i++) {
         if (strcmp(func, "def") == 0) 
             lenv_def(env, syms->cell[i], cur->cell[i+1]);
@@ -688,26 +1876,30 @@ lval *lval_var_builtin(lenv *env, lval *cur, char *func) {
         
         if (strcmp(func, "=") == 0)
             lenv_put(env, syms->cell[i], cur->cell[i+1]);
+
+        if (strcmp(func, "defconst") == 0) {
+            lenv_def(env, syms->cell[i], cur->cell[i+1]);
+            syms->cell[i]->sym->constant = 1;
+        }
     }
     
-    lval_delete(cur);
     return lval_make_s_expr();
 }
 
 lval *lval_builtin_add(lenv* env, lval* a) {
-    return lval_op_builtin(env, a, "+");
+    return lval_op_builtin(env, a, LOP_ADD);
 }
 
 lval *lval_builtin_sub(lenv* env, lval* a) {
-    return lval_op_builtin(env, a, "-");
+    return lval_op_builtin(env, a, LOP_SUB);
 }
 
 lval *lval_builtin_mul(lenv* env, lval* a) {
-    return lval_op_builtin(env, a, "*");
+    return lval_op_builtin(env, a, LOP_MUL);
 }
 
 lval *lval_builtin_div(lenv* env, lval* a) {
-    return lval_op_builtin(env, a, "/");
+    return lval_op_builtin(env, a, LOP_DIV);
 }
 
 lval *lval_def_builtin(lenv *env, lval *cur) {
@@ -718,59 +1910,49 @@ lval *lval_put_builtin(lenv *env, lval *cur) {
     return lval_var_builtin(env, cur, "=");
 }
 
-lval *lval_comp_builtin(lval *cur, char *comp_fun) {
-    LASSERT_NUM(comp_fun, cur, 2);
-    LASSERT_TYPE(comp_fun, cur, 0, LVAL_NUM);
-    LASSERT_TYPE(comp_fun, cur, 1, LVAL_NUM);
-    lval *f = lval_pop(cur, 0);
-    lval *s = lval_pop(cur, 0);
-    lval *ans = NULL;
-    if (strcmp("<", comp_fun) == 0)
-        ans = lval_make_bool(f->num < s->num);
-    if (strcmp("<=", comp_fun) == 0)
-        ans = lval_make_bool(f->num <= s->num);
-    if (strcmp(">", comp_fun) == 0)
-        ans = lval_make_bool(f->num > s->num);
-    if (strcmp(">=", comp_fun) == 0)
-        ans = lval_make_bool(f->num >= s->num);
-    if (strcmp("==", comp_fun) == 0)
-        ans = lval_make_bool(f->num == s->num);
-
-    lval_delete(f);
-    lval_delete(s);
-    lval_delete(cur);
-
-    if (ans == NULL)
-        return lval_make_error("invalid compare function");
-    else
-        return ans;
+lval *lval_defconst_builtin(lenv *env, lval *cur) {
+    return lval_var_builtin(env, cur, "defconst");
+}
+
+// both arguments are numbers, lval_call_builtin has checked them
+lval *lval_comp_builtin(lval *cur, int op) {
+    long f = LVAL_GET_NUM(cur->cell[0]);
+    long s = LVAL_GET_NUM(cur->cell[1]);
+    switch (op) {
+        case LOP_LT: return lval_make_bool(f < s);
+        case LOP_LE: return lval_make_bool(f <= s);
+        case LOP_GT: return lval_make_bool(f > s);
+        case LOP_GE: return lval_make_bool(f >= s);
+    }
+    return lval_make_error("invalid compare function");
 }
 
 lval *lval_smaller_builtin(lenv *env, lval *cur) {
-    return lval_comp_builtin(cur, "<");
+    return lval_comp_builtin(cur, LOP_LT);
 }
 
 lval *lval_smaller_or_equal_builtin(lenv *env, lval *cur) {
-    return lval_comp_builtin(cur, "<=");
+    return lval_comp_builtin(cur, LOP_LE);
 }
 
 lval *lval_bigger_builtin(lenv *env, lval *cur) {
-    return lval_comp_builtin(cur, ">");
+    return lval_comp_builtin(cur, LOP_GT);
 }
 
 lval *lval_bigger_or_equal_builtin(lenv *env, lval *cur) {
-    return lval_comp_builtin(cur, ">=");
+    return lval_comp_builtin(cur, LOP_GE);
 }
 
 lval *lval_equal(lenv *env, lval *f, lval *s) {
-    switch (f->type) {
+    if (f == s) return lval_make_bool(1);
+    switch (LVAL_TYPE(f)) {
         case (LVAL_BOOL):
         case (LVAL_NUM):
-            return lval_make_bool(f->num == s->num);
+            return lval_make_bool(LVAL_GET_NUM(f) == LVAL_GET_NUM(s));
         case (LVAL_ERR):
-            return lval_make_bool(strcmp(f->err, s->err) == 0);
+            return lval_make_bool(strcmp(lval_error_message(f), lval_error_message(s)) == 0);
         case (LVAL_SYM):
-            return lval_make_bool(strcmp(f->sym, s->sym) == 0);
+            return lval_make_bool(f->sym == s->sym);
         case (LVAL_FUN):
             lval *cur_ans;
             if (f->builtin != 0)
@@ -778,9 +1960,7 @@ lval *lval_equal(lenv *env, lval *f, lval *s) {
             else {
                 lval *is_eq_formals = lval_equal(env, f->formals, s->formals);
                 lval *is_eq_body = lval_equal(env, f->body, s->body);
-                cur_ans = lval_make_bool(is_eq_body->num == 1 && is_eq_formals->num == 1);
-                lval_delete(is_eq_body);
-                lval_delete(is_eq_formals);
+                cur_ans = lval_make_bool(LVAL_GET_NUM(is_eq_body) == 1 && LVAL_GET_NUM(is_eq_formals) == 1);
             }
             return cur_ans;
         case (LVAL_SEXPR):
@@ -789,9 +1969,8 @@ lval *lval_equal(lenv *env, lval *f, lval *s) {
                 return lval_make_bool(0);
             for (int i = 0;i < f->count;i++) {
                 lval *cur_eq = lval_equal(env, f->cell[i], s->cell[i]);
-                if (cur_eq->type != LVAL_BOOL || cur_eq->num == 0)
+                if (LVAL_TYPE(cur_eq) != LVAL_BOOL || LVAL_GET_NUM(cur_eq) == 0)
                     return cur_eq;
-                lval_delete(cur_eq);
             }
             return lval_make_bool(1);
         case (LVAL_STR):
@@ -801,50 +1980,53 @@ lval *lval_equal(lenv *env, lval *f, lval *s) {
 }
 
 lval *lval_equal_builtin(lenv *env, lval *cur) {
-    LASSERT_NUM("==", cur, 2);
     // LASSERT(cur, cur->cell[0]->type == cur->cell[1]->type,
     // "In function == values with different types: %s %s",
     // ltype_name(cur->cell[0]->type), ltype_name(cur->cell[1]->type));
-    if (cur->cell[0]->type != cur->cell[1]->type)
+    if (LVAL_TYPE(cur->cell[0]) != LVAL_TYPE(cur->cell[1]))
         return lval_make_bool(0);
-    lval *f = lval_pop(cur, 0);
-    lval *s = lval_pop(cur, 0);
-    lval *ans = lval_equal(env, f, s);
-    lval_delete(f);
-    lval_delete(s);
-    lval_delete(cur);
-    return ans;
+    return lval_equal(env, cur->cell[0], cur->cell[1]);
 }
 
 lval *lval_not_equal_builtin(lenv *env, lval *cur) {
     lval *cur_ans = lval_equal_builtin(env, cur);
-    if (cur_ans->type == LVAL_ERR)
+    if (LVAL_TYPE(cur_ans) == LVAL_ERR)
         return cur_ans;
-    else {
-        lval *ans = lval_make_bool((cur_ans->num + 1) % 2);
-        lval_delete(cur);
-        lval_delete(cur_ans);
-        return ans;
-    }
+    else
+        return lval_make_bool((LVAL_GET_NUM(cur_ans) + 1) % 2);
+}
+
+// builtins are constant unless main is told otherwise
+void lenv_add_builtin_functions(lenv *env, const lbuiltin_desc *desc) {
+    lval *cur_name = lval_make_sym(desc->name);
+    lenv_put(env, cur_name, lval_make_fun(desc));
+    cur_name->sym->constant = 1;
 }
 
-void lenv_add_builtin_functions(lenv *env, char *name, lbuiltin func) {
-    lval *cur_lval_name = lval_make_sym(name);
-    lval *cur_lval_func = lval_make_fun(func);
-    lenv_put(env, cur_lval_name, cur_lval_func);
-    lval_delete(cur_lval_func);
-    lval_delete(cur_lval_name);
+void lenv_thaw_builtins(lenv *env) {
+    for (int i = 0;i < env->count;i++)
+        if (LVAL_TYPE(env->vals[i]) == LVAL_FUN && env->vals[i]->builtin != NULL)
+            env->syms[i]->constant = 0;
+    lenv_const_epoch++;
 }
 
 lval *lval_fun_builtin(lenv *env, lval *cur) {
-    LASSERT_NUM("fun", cur, 2);
-    lval *formals = lval_pop(cur, 0);
-    // if (formals->count == 0)
-    lval *name = lval_pop(formals, 0);
-    lval *body = lval_pop(cur, 0);
-
-    lval *func = lval_make_lambda(formals, body);
-    lenv_put(env, name, func);
+    lval *formals = cur->cell[0];
+    LASSERT(cur, formals->count > 0, "Function 'fun' passed no name to define.");
+    for (int i = 0;i < formals->count;i++)
+        LASSERT(cur, (LVAL_TYPE(formals->cell[i]) == LVAL_SYM),
+        "Function 'fun' cannot define non-symbol. Got %s, Expected %s.",
+        ltype_name(LVAL_TYPE(formals->cell[i])), ltype_name(LVAL_SYM));
+    lval *name = formals->cell[0];
+    lval *rest = lval_make_q_expr();
+    for (int i = 1;i < formals->count;i++) lval_add(rest, formals->cell[i]);
+
+    LASSERT(cur, !lenv_is_constant(env, name->sym), "Cannot redefine constant '%v'.", name);
+
+    // resolved after it is bound, so that recursive calls resolve too
+    lval *fun = lval_make_closure(env, rest, cur->cell[1]);
+    lenv_put(env, name, fun);
+    lval_resolve_closure(fun);
     return lval_make_s_expr();
 }
 
@@ -854,45 +2036,32 @@ lval *lval_eval_comparison(lenv *env, lval *cur) {
 }
 
 lval *lval_if_builtin(lenv *env, lval *cur) {
-    LASSERT_NUM("if", cur, 3)
-    LASSERT_TYPE("if", cur, 0, LVAL_BOOL)
-    LASSERT_TYPE("if", cur, 1, LVAL_QEXPR)
-    LASSERT_TYPE("if", cur, 2, LVAL_QEXPR)
-
-    lval *expr_res = lval_pop(cur, 0);
-    lval *ans;
-
-    cur->cell[0]->type = LVAL_SEXPR;
-    cur->cell[1]->type = LVAL_SEXPR;
-    if (expr_res->num == 1)
-        ans = lval_eval(env, lval_pop(cur, 0));
+    if (LVAL_GET_NUM(cur->cell[0]) == 1)
+        return lval_eval_s_expression(env, cur->cell[1]);
     else 
-        ans = lval_eval(env, lval_pop(cur, 1));
-    
-    lval_delete(expr_res);
-    lval_delete(cur);
-    return ans;
+        return lval_eval_s_expression(env, cur->cell[2]);
 }
 
 lval *lval_load_builtin(lenv *env, lval *cur) {
-    LASSERT_NUM("load", cur, 1)
-    LASSERT_TYPE("load", cur, 0, LVAL_STR);
-
     mpc_result_t res;
     if (mpc_parse_contents(cur->cell[0]->str, Lispy, &res)) {
         lval *expr = lval_read(res.output);
-        while (expr->count) {
-            lval *cur_expr = lval_pop(expr, 0);
-            // lval_print(cur_expr);
+        mpc_ast_delete(res.output);
+
+        // the forms outlive every arena reset below
+        gc_promote(expr);
+        int roots = gc_stack_count;
+        gc_push(expr);
+        for (int i = 0;i < expr->count;i++) {
+            // lval_print(expr->cell[i]);
             // printf("\n");
-            lval *cur_ans = lval_eval(env, cur_expr);
-            if (cur_ans->type == LVAL_ERR)
+            lval *cur_ans = lval_eval(env, expr->cell[i]);
+            if (LVAL_TYPE(cur_ans) == LVAL_ERR)
                 lval_print(cur_ans);
-            lval_delete(cur_ans);
+            gc_end_form();
         }
+        gc_pop_to(roots);
 
-        lval_delete(cur);
-        lval_delete(expr);
         return lval_make_s_expr();
     }
     else {
@@ -908,80 +2077,1555 @@ lval *lval_print_builtin(lenv *env, lval *cur) {
         printf(" ");
     }
     printf("\n");
-    lval_delete(cur);
     return lval_make_s_expr();
 }
 
+lval *lval_stat_pair(char *name, long val) {
+    return lval_add(lval_add(lval_make_q_expr(), lval_make_sym(name)), lval_make_num(val));
+}
+
+lval *lval_alloc_stats_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    long pages = 0, used = 0;
+    for (int i = 0;i < SLAB_CLASSES;i++) {
+        pages += slab_classes[i].page_count;
+        used += slab_classes[i].live * SLAB_CLASS_SIZE(i);
+    }
+
+    lval *ans = lval_make_q_expr();
+    lval_add(ans, lval_stat_pair("lvals", slab_live_lvals));
+    lval_add(ans, lval_stat_pair("lenvs", slab_live_lenvs));
+    lval_add(ans, lval_stat_pair("pages", pages));
+    lval_add(ans, lval_stat_pair("used", used));
+    lval_add(ans, lval_stat_pair("capacity", pages * (long)(SLAB_PAGE_SIZE - SLAB_PAGE_HEADER)));
+    return ans;
+}
+
 lval *lval_error_builtin(lenv *env, lval *cur) {
-    LASSERT_NUM("error", cur, 1)
-    LASSERT_TYPE("error", cur, 0, LVAL_STR)
-    lval *error = lval_make_error(cur->cell[0]->str);
-    lval_delete(cur);
-    return error;
+    return lval_make_error("%v", cur->cell[0]);
 }
 
-void lenv_add_functions(lenv *env) {
-    lenv_add_builtin_functions(env, "+", lval_builtin_add);
-    lenv_add_builtin_functions(env, "-", lval_builtin_sub);
-    lenv_add_builtin_functions(env, "*", lval_builtin_mul);
-    lenv_add_builtin_functions(env, "/", lval_builtin_div);
-    lenv_add_builtin_functions(env, "head", lval_head_builtin);
-    lenv_add_builtin_functions(env, "tail", lval_tail_builtin);
-    lenv_add_builtin_functions(env, "join", lval_join_builtin);
-    lenv_add_builtin_functions(env, "list", lval_list_builtin);
-    lenv_add_builtin_functions(env, "eval", lval_eval_builtin);
-    lenv_add_builtin_functions(env, "\\", lval_lambda_builtin);
-    lenv_add_builtin_functions(env, "def", lval_def_builtin);
-    lenv_add_builtin_functions(env, "=", lval_put_builtin);
-    lenv_add_builtin_functions(env, "fun", lval_fun_builtin);
-    lenv_add_builtin_functions(env, "<", lval_smaller_builtin);
-    lenv_add_builtin_functions(env, "<=", lval_smaller_or_equal_builtin);
-    lenv_add_builtin_functions(env, ">", lval_bigger_builtin);
-    lenv_add_builtin_functions(env, ">=", lval_bigger_or_equal_builtin);
-    lenv_add_builtin_functions(env, "==", lval_equal_builtin);
-    lenv_add_builtin_functions(env, "!=", lval_not_equal_builtin);
-    lenv_add_builtin_functions(env, "if", lval_if_builtin);
-    lenv_add_builtin_functions(env, "load", lval_load_builtin);
-    lenv_add_builtin_functions(env, "print", lval_print_builtin);
-    lenv_add_builtin_functions(env, "error", lval_error_builtin);
+lval *lval_gc_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    return lval_make_num(gc_collect());
 }
 
-lval *lval_eval_s_expression(lenv *env, lval *cur) {
-    for (int i = 0;i < cur->count;i++) cur->cell[i] = lval_eval(env, cur->cell[i]);
+lval *lval_gc_pauses_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    static char *names[GC_PAUSE_BUCKETS] = {"<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms"};
+    lval *ans = lval_make_q_expr();
+    lval_add(ans, lval_stat_pair("count", gc_pause_count));
+    lval_add(ans, lval_stat_pair("total-us", gc_pause_total));
+    lval_add(ans, lval_stat_pair("max-us", gc_pause_max));
+    for (int i = 0;i < GC_PAUSE_BUCKETS;i++)
+        lval_add(ans, lval_stat_pair(names[i], gc_pause_buckets[i]));
+    return ans;
+}
+
+lval *lval_hashcons_stats_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    lval *ans = lval_make_q_expr();
+    lval_add(ans, lval_stat_pair("read", hashcons_lookups));
+    lval_add(ans, lval_stat_pair("shared", hashcons_hits));
+    lval_add(ans, lval_stat_pair("entries", hashcons_count));
+    lval_add(ans, lval_stat_pair("dedup-pct", hashcons_lookups ? hashcons_hits * 100 / hashcons_lookups : 0));
+    return ans;
+}
 
+lval *lval_gc_stats_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    lval *ans = lval_make_q_expr();
+    lval_add(ans, lval_stat_pair("collections", gc_collections));
+    lval_add(ans, lval_stat_pair("minor", gc_minor_collections));
+    lval_add(ans, lval_stat_pair("promoted", gc_promoted_total));
+    lval_add(ans, lval_stat_pair("arena-resets", gc_arena_resets));
+    lval_add(ans, lval_stat_pair("live", slab_live_lvals + slab_live_lenvs));
+    lval_add(ans, lval_stat_pair("heap", slab_live_bytes()));
+    lval_add(ans, lval_stat_pair("threshold", gc_threshold));
+    lval_add(ans, lval_stat_pair("freed", gc_freed_total));
+    return ans;
+}
+
+lval *lval_ic_stats_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    lval *ans = lval_make_q_expr();
+    lval_add(ans, lval_stat_pair("hits", ic_hits));
+    lval_add(ans, lval_stat_pair("misses", ic_misses));
+    lval_add(ans, lval_stat_pair("version", lenv_global_version));
+    lval_add(ans, lval_stat_pair("hit-pct", ic_hits + ic_misses ? ic_hits * 100 / (ic_hits + ic_misses) : 0));
+    return ans;
+}
+
+// counted by the trace JIT in front of lval_vm_run
+static long jit_traces_recorded;
+static long jit_traces_aborted;
+static long jit_traces_executed;
+
+lval *lval_jit_stats_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    lval *ans = lval_make_q_expr();
+    lval_add(ans, lval_stat_pair("recorded", jit_traces_recorded));
+    lval_add(ans, lval_stat_pair("aborted", jit_traces_aborted));
+    lval_add(ans, lval_stat_pair("executed", jit_traces_executed));
+    return ans;
+}
+
+// snapshots taken by env-snapshot, numbered from the oldest
+static lenv **lenv_snapshots;
+static int lenv_snapshot_count;
+
+lval *lval_env_snapshot_builtin(lenv *env, lval *cur) {
+    (void)env;
+    (void)cur;
+    lenv *snap = lenv_copy(lenv_global);
+    gc_register_root(snap);
+    lenv_snapshots = realloc(lenv_snapshots, sizeof(lenv*) * (lenv_snapshot_count + 1));
+    lenv_snapshots[lenv_snapshot_count++] = snap;
+    return lval_make_num(lenv_snapshot_count - 1);
+}
+
+// restoring a snapshot forgets the ones taken after it
+lval *lval_env_restore_builtin(lenv *env, lval *cur) {
+    (void)env;
+    long n = LVAL_GET_NUM(cur->cell[0]);
+    LASSERT(cur, n >= 0 && n < lenv_snapshot_count,
+    "Function 'env-restore' passed unknown snapshot %i.", (int)n)
+
+    while (lenv_snapshot_count > n + 1)
+        gc_unregister_root(lenv_snapshots[--lenv_snapshot_count]);
+    lenv_restore(lenv_global, lenv_snapshots[n]);
+    return lval_make_s_expr();
+}
+
+static const lbuiltin_desc lval_builtins[] = {
+    {"+", lval_builtin_add, LOP_ADD, -1, {0}},
+    {"-", lval_builtin_sub, LOP_SUB, -1, {0}},
+    {"*", lval_builtin_mul, LOP_MUL, -1, {0}},
+    {"/", lval_builtin_div, LOP_DIV, -1, {0}},
+    {"head", lval_head_builtin, LOP_CALL, -1, {0}},
+    {"tail", lval_tail_builtin, LOP_CALL, -1, {0}},
+    {"join", lval_join_builtin, LOP_CALL, -1, {0}},
+    {"list", lval_list_builtin, LOP_CALL, -1, {0}},
+    {"eval", lval_eval_builtin, LOP_CALL, -1, {0}},
+    {"\\", lval_lambda_builtin, LOP_CALL, 2, {LVAL_QEXPR, LVAL_QEXPR}},
+    {"def", lval_def_builtin, LOP_CALL, -1, {0}},
+    {"=", lval_put_builtin, LOP_CALL, -1, {0}},
+    {"defconst", lval_defconst_builtin, LOP_CALL, -1, {0}},
+    {"fun", lval_fun_builtin, LOP_CALL, 2, {LVAL_QEXPR, LVAL_QEXPR}},
+    {"<", lval_smaller_builtin, LOP_LT, 2, {LVAL_NUM, LVAL_NUM}},
+    {"<=", lval_smaller_or_equal_builtin, LOP_LE, 2, {LVAL_NUM, LVAL_NUM}},
+    {">", lval_bigger_builtin, LOP_GT, 2, {LVAL_NUM, LVAL_NUM}},
+    {">=", lval_bigger_or_equal_builtin, LOP_GE, 2, {LVAL_NUM, LVAL_NUM}},
+    {"==", lval_equal_builtin, LOP_EQ, 2, {LVAL_ANY, LVAL_ANY}},
+    {"!=", lval_not_equal_builtin, LOP_NE, 2, {LVAL_ANY, LVAL_ANY}},
+    {"if", lval_if_builtin, LOP_CALL, 3, {LVAL_BOOL, LVAL_QEXPR, LVAL_QEXPR}},
+    {"load", lval_load_builtin, LOP_CALL, 1, {LVAL_STR}},
+    {"print", lval_print_builtin, LOP_CALL, -1, {0}},
+    {"error", lval_error_builtin, LOP_CALL, 1, {LVAL_STR}},
+    {"alloc-stats", lval_alloc_stats_builtin, LOP_CALL, 0, {0}},
+    {"gc", lval_gc_builtin, LOP_CALL, 0, {0}},
+    {"gc-stats", lval_gc_stats_builtin, LOP_CALL, 0, {0}},
+    {"gc-pauses", lval_gc_pauses_builtin, LOP_CALL, 0, {0}},
+    {"hashcons-stats", lval_hashcons_stats_builtin, LOP_CALL, 0, {0}},
+    {"ic-stats", lval_ic_stats_builtin, LOP_CALL, 0, {0}},
+    {"jit-stats", lval_jit_stats_builtin, LOP_CALL, 0, {0}},
+    {"env-snapshot", lval_env_snapshot_builtin, LOP_CALL, 0, {0}},
+    {"env-restore", lval_env_restore_builtin, LOP_CALL, 1, {LVAL_NUM}},
+};
+
+// two numbers through one of the arithmetic or comparison opcodes
+lval *lval_num_op(int op, lval *f, lval *s) {
+    switch (op) {
+        case LOP_LT: return lval_make_bool(LVAL_GET_NUM(f) < LVAL_GET_NUM(s));
+        case LOP_LE: return lval_make_bool(LVAL_GET_NUM(f) <= LVAL_GET_NUM(s));
+        case LOP_GT: return lval_make_bool(LVAL_GET_NUM(f) > LVAL_GET_NUM(s));
+        case LOP_GE: return lval_make_bool(LVAL_GET_NUM(f) >= LVAL_GET_NUM(s));
+        case LOP_EQ: return lval_make_bool(LVAL_GET_NUM(f) == LVAL_GET_NUM(s));
+        case LOP_NE: return lval_make_bool(LVAL_GET_NUM(f) != LVAL_GET_NUM(s));
+    }
+    return lval_eval_op(f, s, op);
+}
+
+// the error for arguments a that do not fit desc, NULL if they do
+lval *lval_check_builtin(const lbuiltin_desc *desc, lval *a) {
+    if (desc->argc >= 0) {
+        LASSERT_NUM(desc->name, a, desc->argc)
+        for (int i = 0;i < desc->argc;i++) {
+            if (desc->types[i] != LVAL_ANY)
+                LASSERT_TYPE(desc->name, a, i, desc->types[i])
+        }
+    }
+    return NULL;
+}
+
+lval *lval_call_builtin(lenv *env, lval *fun, lval *a) {
+    const lbuiltin_desc *desc = fun->desc;
+    lval *err = lval_check_builtin(desc, a);
+    if (err != NULL) return err;
+
+    if (desc->op != LOP_CALL && a->count == 2 && LVAL_TYPE(a->cell[0]) == LVAL_NUM && LVAL_TYPE(a->cell[1]) == LVAL_NUM)
+        return lval_num_op(desc->op, a->cell[0], a->cell[1]);
+    return desc->func(env, a);
+}
+
+void lenv_add_functions(lenv *env) {
+    for (size_t i = 0;i < sizeof(lval_builtins) / sizeof(lval_builtins[0]);i++)
+        lenv_add_builtin_functions(env, &lval_builtins[i]);
+}
+
+lval *lval_apply(lenv *env, lval *cur) {
     for (int i = 0;i < cur->count;i++) 
-        if (cur->cell[i]->type == LVAL_ERR) 
-            return lval_take(cur, i);
+        if (LVAL_TYPE(cur->cell[i]) == LVAL_ERR) 
+            return cur->cell[i];
 
     if (cur->count == 0) return cur;
-    if (cur->count == 1) return lval_eval(env, lval_take(cur, 0));
+    if (cur->count == 1) {
+        lval *f = cur->cell[0];
+        if (LVAL_TYPE(f) == LVAL_FUN && f->builtin != NULL && f->desc->argc == 0)
+            return lval_call(env, lval_pop(cur, 0), cur);
+        return lval_eval(env, f);
+    }
 
     lval *f = lval_pop(cur, 0);
-    if (f->type != LVAL_FUN) {
+    gc_push(f);
+    if (LVAL_TYPE(f) != LVAL_FUN) {
         lval* err = lval_make_error(
         "S-Expression starts with incorrect type. "
         "Got %s, Expected %s.\n",
-        ltype_name(f->type), ltype_name(LVAL_FUN));
+        ltype_name(LVAL_TYPE(f)), ltype_name(LVAL_FUN));
         lval_print(f);
-        lval_delete(f); lval_delete(cur);
         return err;
     }
-    lval *ans = lval_call(env, f, cur);
-    lval_delete(f);
+    return lval_call(env, f, cur);
+}
+
+// cur may also be a Q-expression (a lambda body or an if branch); it is
+// only read, the evaluated elements go into a fresh argument list
+lval *lval_eval_s_expression(lenv *env, lval *cur) {
+    int roots = gc_stack_count;
+tail:
+    gc_pop_to(roots);
+    gc_push(env);
+    gc_push(cur);
+    gc_safe_point();
+
+    // Calls that fill a lambda's formals exactly, directly or by
+    // saturating a partial application, evaluate their arguments straight
+    // into the callee's frame; everything else goes through an argument
+    // list and lval_apply.
+    lval *f = cur->count > 1 ? lval_eval(env, cur->cell[0]) : NULL;
+    lval *fun = f;
+    lval *bound = NULL;
+    if (f != NULL && LVAL_TYPE(f) == LVAL_FUN && f->builtin == NULL && f->target != NULL) {
+        fun = f->target;
+        bound = f->bound;
+    }
+    int given = bound != NULL ? bound->count : 0;
+    if (fun != NULL && LVAL_TYPE(fun) == LVAL_FUN && fun->builtin == NULL && fun->arity == given + cur->count - 1) {
+        gc_push(f);
+        lenv *frame = lenv_make_frame(fun);
+        gc_push(frame);
+        for (int i = 0;i < given;i++) {
+            frame->vals[i] = bound->cell[i];
+            gc_write_barrier_env(frame, bound->cell[i]);
+        }
+        frame->count = given;
+        lval *err = NULL;
+        for (int i = 1;i < cur->count;i++) {
+            lval *x = lval_eval(env, cur->cell[i]);
+            if (err == NULL && LVAL_TYPE(x) == LVAL_ERR) err = x;
+            frame->vals[frame->count++] = x;
+            gc_write_barrier_env(frame, x);
+        }
+        if (frame->count > LENV_INDEX_MIN) lenv_reindex(frame);
+
+        // the body is in tail position: it replaces env and cur so tail
+        // recursion runs in constant C stack, compiled bodies loop in the VM
+        if (err == NULL && fun->code == NULL) {
+            env = frame;
+            cur = fun->body;
+            goto tail;
+        }
+        lval *ans = err != NULL ? err : lval_run(frame, fun);
+        gc_pop_to(roots);
+        return ans;
+    }
+
+    lval *args = lval_alloc(LVAL_SEXPR);
+    args->count = 0;
+    args->cell = malloc(sizeof(lval*) * cur->count);
+    gc_push(args);
+    if (f != NULL) {
+        args->cell[args->count++] = f;
+        gc_write_barrier(args, f);
+    }
+    while (args->count < cur->count) {
+        lval *x = lval_eval(env, cur->cell[args->count]);
+        args->cell[args->count++] = x;
+        gc_write_barrier(args, x);
+    }
+
+    // lval_apply up to the point where a lambda's body or an if's branch
+    // would be evaluated
+    int direct = f != NULL && LVAL_TYPE(f) == LVAL_FUN && (f->builtin == NULL || f->builtin == lval_if_builtin);
+    for (int i = 0;direct && i < args->count;i++)
+        if (LVAL_TYPE(args->cell[i]) == LVAL_ERR) direct = 0;
+    if (direct) {
+        lval_pop(args, 0);
+        lval *ans = NULL;
+        if (f->builtin != NULL) {
+            ans = lval_check_builtin(f->desc, args);
+            // an if's branch is in tail position as well
+            if (ans == NULL) {
+                cur = args->cell[LVAL_GET_NUM(args->cell[0]) == 1 ? 1 : 2];
+                goto tail;
+            }
+        }
+        else {
+            lenv *frame;
+            gc_push(f);
+            ans = lval_call_prepare(env, &f, args, &frame);
+            if (ans == NULL && f->code == NULL) {
+                env = frame;
+                cur = f->body;
+                goto tail;
+            }
+            if (ans == NULL) ans = lval_run(frame, f);
+        }
+        gc_pop_to(roots);
+        return ans;
+    }
+
+    lval *ans = lval_apply(env, args);
+    gc_pop_to(roots);
     return ans;
 }
 
 lval *lval_eval(lenv *env, lval *cur) {
-    if (cur->type == LVAL_SYM) {
-        lval *x = lenv_get(env, cur);
-        lval_delete(cur);
+    if (LVAL_TYPE(cur) == LVAL_SYM) {
+        if (cur->depth < 0) {
+            if (cur->epoch == lenv_const_epoch && !cur->sym->local) return cur->constant;
+            return lenv_get(env, cur);
+        }
+        if (cur->slot >= 0) {
+            lenv *frame = env;
+            if (cur->depth > 0) {
+                if (env->par != cur->scope || cur->epoch != lenv_shadow_epoch || lenv_find(env, cur->sym) >= 0)
+                    frame = NULL;
+                else
+                    for (int d = cur->depth;d > 0 && frame != NULL;d--) frame = frame->par;
+            }
+            if (frame != NULL && cur->slot < frame->count && frame->syms[cur->slot] == cur->sym)
+                return frame->vals[cur->slot];
+        }
+        lval *x = lenv_get_global(env, cur);
         // lval_print(x);
         return x;
     }
-    if (cur->type == LVAL_SEXPR) return lval_eval_s_expression(env, cur);
+    if (LVAL_TYPE(cur) == LVAL_SEXPR) return lval_eval_s_expression(env, cur);
     return cur;
 }
 
+// native code runs on the VM stack, sp pointing past its top, and leaves
+// it at the bytecode pc the VM should go on from, -1 after OP_RETURN
+typedef struct {
+    long pc;
+    lval **sp;
+} jit_exit;
+
+typedef jit_exit (*jit_fn)(lenv *env, lval **sp);
+
+// lambda bodies are compiled once, when the closure is made, into code for
+// a stack machine whose operand stack is the collector's root stack
+enum {
+    OP_CONST,       // k: push pool[k]
+    OP_CONSTHINT,   // k: push the constant pool[k] refers to
+    OP_LOCAL,       // slot k: push frame slot, pool[k] names it
+    OP_SYM,         // k: push lval_eval of the symbol pool[k]
+    OP_SINGLE,      // evaluate a one-element S-expression's value
+    OP_CALL,        // n: apply the top n values
+    OP_TAILCALL,    // n: OP_CALL whose value the code returns
+    OP_CALL_BUILTIN, // n: as OP_CALL, the function expected to be a builtin
+    OP_BINOP,       // op: apply the top 3 values, inline for two numbers
+    OP_BINOP_LC,    // op slot j k: OP_LOCAL slot j, OP_CONST k, OP_BINOP op
+    OP_IF,          // else end k: branch on the top value for pool[k]
+    OP_IF_CMP,      // op else end k: OP_BINOP op, OP_IF else end k
+    OP_JUMP,        // pc
+    OP_RETURN
+};
+
+struct lcode {
+    int *ops;
+    int count;
+    int cap;
+
+    // nodes of the body the code refers to, kept alive by the body
+    lval **pool;
+    int pool_count;
+    int pool_cap;
+
+    // native holds the machine code once calls reaches JIT_THRESHOLD, and
+    // is no longer entered after JIT_MAX_DEOPTS fallbacks to the VM
+    int calls;
+    int deopts;
+    union {
+        unsigned char *bytes;
+        jit_fn enter;
+    } native;
+    size_t native_size;
+};
+
+void lcode_emit(lcode *code, int op) {
+    if (code->count == code->cap) {
+        code->cap = code->cap ? code->cap * 2 : 32;
+        code->ops = realloc(code->ops, sizeof(int) * code->cap);
+    }
+    code->ops[code->count++] = op;
+}
+
+int lcode_pool(lcode *code, lval *x) {
+    if (code->pool_count == code->pool_cap) {
+        code->pool_cap = code->pool_cap ? code->pool_cap * 2 : 8;
+        code->pool = realloc(code->pool, sizeof(lval*) * code->pool_cap);
+    }
+    code->pool[code->pool_count] = x;
+    return code->pool_count++;
+}
+
+void lcode_free(lcode *code) {
+#ifdef VM_JIT
+    if (code->native.bytes != NULL) munmap(code->native.bytes, code->native_size);
+#endif
+    free(code->ops);
+    free(code->pool);
+    free(code);
+}
+
+// the builtin a symbol node stands for if it is a builtin constant
+const lbuiltin_desc *lval_const_builtin(lval *x) {
+    if (LVAL_TYPE(x) != LVAL_SYM || x->depth >= 0) return NULL;
+    lval *val = x->constant;
+    if (LVAL_TYPE(val) != LVAL_FUN || val->builtin == NULL) return NULL;
+    return val->desc;
+}
+
+void lval_compile_sexpr(lcode *code, lval *cur);
+
+// symbols go through the hints lval_resolve left: a local becomes a frame
+// slot, a constant its value, and anything else is looked up by lval_eval
+void lval_compile_expr(lcode *code, lval *cur) {
+    switch (LVAL_TYPE(cur)) {
+        case LVAL_SYM:
+            if (cur->depth < 0) {
+                lcode_emit(code, OP_CONSTHINT);
+                lcode_emit(code, lcode_pool(code, cur));
+            }
+            else if (cur->depth == 0 && cur->slot >= 0) {
+                lcode_emit(code, OP_LOCAL);
+                lcode_emit(code, cur->slot);
+                lcode_emit(code, lcode_pool(code, cur));
+            }
+            else {
+                lcode_emit(code, OP_SYM);
+                lcode_emit(code, lcode_pool(code, cur));
+            }
+            break;
+        case LVAL_SEXPR:
+            lval_compile_sexpr(code, cur);
+            break;
+        default:
+            lcode_emit(code, OP_CONST);
+            lcode_emit(code, lcode_pool(code, cur));
+            break;
+    }
+}
+
+// cur is evaluated the way lval_eval_s_expression would, whether it is an
+// S-expression or the Q-expression of a body or an if branch
+void lval_compile_sexpr(lcode *code, lval *cur) {
+    if (cur->count == 0) {
+        lcode_emit(code, OP_CONST);
+        lcode_emit(code, lcode_pool(code, cur));
+        return;
+    }
+    if (cur->count == 1) {
+        lval_compile_expr(code, cur->cell[0]);
+        lcode_emit(code, OP_SINGLE);
+        return;
+    }
+
+    const lbuiltin_desc *desc = lval_const_builtin(cur->cell[0]);
+    if (desc != NULL && desc->func == lval_if_builtin && cur->count == 4
+        && LVAL_TYPE(cur->cell[2]) == LVAL_QEXPR && LVAL_TYPE(cur->cell[3]) == LVAL_QEXPR) {
+        lval_compile_expr(code, cur->cell[0]);
+        lval *cond = cur->cell[1];
+        const lbuiltin_desc *cmp = LVAL_TYPE(cond) == LVAL_SEXPR && cond->count == 3
+            ? lval_const_builtin(cond->cell[0]) : NULL;
+        if (cmp != NULL && cmp->op >= LOP_LT) {
+            for (int i = 0;i < 3;i++) lval_compile_expr(code, cond->cell[i]);
+            lcode_emit(code, OP_IF_CMP);
+            lcode_emit(code, cmp->op);
+        }
+        else {
+            lval_compile_expr(code, cond);
+            lcode_emit(code, OP_IF);
+        }
+        int at = code->count;
+        lcode_emit(code, 0);
+        lcode_emit(code, 0);
+        lcode_emit(code, lcode_pool(code, cur));
+        lval_compile_sexpr(code, cur->cell[2]);
+        lcode_emit(code, OP_JUMP);
+        int jump = code->count;
+        lcode_emit(code, 0);
+        code->ops[at] = code->count;
+        lval_compile_sexpr(code, cur->cell[3]);
+        code->ops[at + 1] = code->count;
+        code->ops[jump] = code->count;
+        return;
+    }
+
+    if (desc != NULL && desc->op != LOP_CALL && cur->count == 3) {
+        lval *x = cur->cell[1], *k = cur->cell[2];
+        if (LVAL_TYPE(x) == LVAL_SYM && x->depth == 0 && x->slot >= 0 && LVAL_TYPE(k) == LVAL_NUM) {
+            lval_compile_expr(code, cur->cell[0]);
+            lcode_emit(code, OP_BINOP_LC);
+            lcode_emit(code, desc->op);
+            lcode_emit(code, x->slot);
+            lcode_emit(code, lcode_pool(code, x));
+            lcode_emit(code, lcode_pool(code, k));
+            return;
+        }
+    }
+
+    for (int i = 0;i < cur->count;i++) lval_compile_expr(code, cur->cell[i]);
+    if (desc != NULL && desc->op != LOP_CALL && cur->count == 3) {
+        lcode_emit(code, OP_BINOP);
+        lcode_emit(code, desc->op);
+        return;
+    }
+    lcode_emit(code, desc != NULL ? OP_CALL_BUILTIN : OP_CALL);
+    lcode_emit(code, cur->count);
+}
+
+// number of operands of each opcode
+int lcode_op_len(int op) {
+    switch (op) {
+        case OP_SINGLE:
+        case OP_RETURN:
+            return 0;
+        case OP_LOCAL:
+            return 2;
+        case OP_IF:
+            return 3;
+        case OP_BINOP_LC:
+        case OP_IF_CMP:
+            return 4;
+    }
+    return 1;
+}
+
+// whether the code from pc on only returns
+int lcode_tail(lcode *code, int pc) {
+    while (code->ops[pc] == OP_JUMP) pc = code->ops[pc + 1];
+    return code->ops[pc] == OP_RETURN;
+}
+
+lcode *lval_compile(lval *body) {
+    lcode *code = calloc(1, sizeof(lcode));
+    lval_compile_sexpr(code, body);
+    lcode_emit(code, OP_RETURN);
+    for (int pc = 0;pc < code->count;pc += 1 + lcode_op_len(code->ops[pc]))
+        if (code->ops[pc] == OP_CALL && lcode_tail(code, pc + 2)) code->ops[pc] = OP_TAILCALL;
+    return code;
+}
+
+#define VM_TOP(i) (((lval**)gc_stack)[gc_stack_count - 1 - (i)])
+
+// the frame for the top n values of the stack when they are a lambda and
+// exactly its arguments, NULL otherwise
+lenv *lval_vm_frame(int n) {
+    lval **sp = (lval**)gc_stack + gc_stack_count - n;
+    lval *f = sp[0];
+    if (LVAL_TYPE(f) != LVAL_FUN || f->builtin != NULL || f->target != NULL || f->arity != n - 1)
+        return NULL;
+    lenv *frame = lenv_make_frame(f);
+    for (int i = 1;i < n;i++) {
+        frame->vals[i - 1] = sp[i];
+        gc_write_barrier_env(frame, sp[i]);
+    }
+    frame->count = n - 1;
+    if (frame->count > LENV_INDEX_MIN) lenv_reindex(frame);
+    return frame;
+}
+
+// applies the top n values of the stack, the function first; all but exact
+// lambda calls go through lval_apply, so errors match the evaluator's
+lval *lval_vm_call(lenv *env, int n) {
+    lval **sp = (lval**)gc_stack + gc_stack_count - n;
+    for (int i = 0;i < n;i++)
+        if (LVAL_TYPE(sp[i]) == LVAL_ERR) return sp[i];
+
+    lenv *frame = lval_vm_frame(n);
+    if (frame != NULL) return lval_run(frame, sp[0]);
+
+    int roots = gc_stack_count;
+    lval *args = lval_alloc(LVAL_SEXPR);
+    args->count = n;
+    args->cell = malloc(sizeof(lval*) * n);
+    memcpy(args->cell, sp, sizeof(lval*) * n);
+    gc_push(args);
+    lval *ans = lval_apply(env, args);
+    gc_pop_to(roots);
+    return ans;
+}
+
+// as lval_vm_call, but when the call comes down to running a lambda's body
+// the result is NULL, with *fun and *frame set by lval_call_prepare
+lval *lval_vm_tail(lenv *env, int n, lval **fun, lenv **frame) {
+    lval **sp = (lval**)gc_stack + gc_stack_count - n;
+    lval *f = sp[0];
+    if (LVAL_TYPE(f) != LVAL_FUN || f->builtin != NULL) return lval_vm_call(env, n);
+    for (int i = 0;i < n;i++)
+        if (LVAL_TYPE(sp[i]) == LVAL_ERR) return sp[i];
+
+    *fun = f;
+    *frame = lval_vm_frame(n);
+    if (*frame != NULL) return NULL;
+
+    int roots = gc_stack_count;
+    lval *args = lval_alloc(LVAL_SEXPR);
+    args->count = n - 1;
+    args->cell = malloc(sizeof(lval*) * (n - 1));
+    memcpy(args->cell, sp + 1, sizeof(lval*) * (n - 1));
+    gc_push(args);
+    lval *ans = lval_call_prepare(env, fun, args, frame);
+    gc_pop_to(roots);
+    return ans;
+}
+
+// as lval_vm_call, for a call headed by what should be a builtin: the
+// arguments go to it as they are, without the copy of the whole call
+// lval_apply would pop the head off
+lval *lval_vm_call_builtin(lenv *env, int n) {
+    lval **sp = (lval**)gc_stack + gc_stack_count - n;
+    lval *f = sp[0];
+    if (LVAL_TYPE(f) != LVAL_FUN || f->builtin == NULL) return lval_vm_call(env, n);
+    for (int i = 0;i < n;i++)
+        if (LVAL_TYPE(sp[i]) == LVAL_ERR) return sp[i];
+
+    int roots = gc_stack_count;
+    lval *args = lval_alloc(LVAL_SEXPR);
+    args->count = n - 1;
+    args->cell = malloc(sizeof(lval*) * (n - 1));
+    memcpy(args->cell, sp + 1, sizeof(lval*) * (n - 1));
+    gc_push(args);
+    lval *ans = lval_call_builtin(env, f, args);
+    gc_pop_to(roots);
+    return ans;
+}
+
+// the value of a one-element S-expression whose element evaluated to x
+lval *lval_vm_single(lenv *env, lval *x) {
+    if (LVAL_TYPE(x) == LVAL_FUN && x->builtin != NULL && x->desc->argc == 0)
+        return lval_call_builtin(env, x, lval_make_s_expr());
+    return lval_eval(env, x);
+}
+
+// replaces a function and its two arguments on top of the stack with the
+// result of the call, done inline when it is the builtin for op on numbers
+void lval_vm_binop(lenv *env, int op) {
+    lval *f = VM_TOP(2), *a = VM_TOP(1), *b = VM_TOP(0);
+    lval *x;
+    if (LVAL_TYPE(f) == LVAL_FUN && f->builtin != NULL && f->desc->op == op
+        && LVAL_TYPE(a) == LVAL_NUM && LVAL_TYPE(b) == LVAL_NUM)
+        x = lval_num_op(op, a, b);
+    else
+        x = lval_vm_call(env, 3);
+    gc_pop_to(gc_stack_count - 3);
+    gc_push(x);
+}
+
+#ifdef VM_JIT
+// A baseline JIT: once a lambda has been called JIT_THRESHOLD times its
+// bytecode is translated opcode by opcode into x86-64 from fixed
+// templates. The native code works on the same stack as the VM. Fixnum
+// arithmetic and comparisons, if, constants and frame slots are inlined
+// behind guards that the interpreter would check the same way; every
+// other opcode calls back into the runtime. A failed guard or an
+// overflow deoptimizes: the code returns the pc of the opcode it could
+// not run, with the stack as the VM would have it there, and lval_vm_run
+// takes over from that pc.
+//
+// registers: rbx holds the frame, r12 the stack pointer, rax, rcx and rdx
+// are scratch. Anything C touches is reloaded from memory after a call.
+#define JIT_THRESHOLD 64
+#define JIT_MAX_DEOPTS 64
+
+// --no-jit leaves compiled lambdas on the bytecode interpreter
+static int jit_enabled = 1;
+
+typedef struct {
+    unsigned char *buf;
+    int len;
+    int cap;
+
+    // rel32 fields still to fill: with the native offset of bytecode pc,
+    // or with the exit that deoptimizes to it
+    struct {
+        int at;
+        int pc;
+        int deopt;
+    } *fixups;
+    int fixup_count;
+    int fixup_cap;
+
+    // set while emitting a trace, whose failed guards leave for the
+    // baseline code of the opcode rather than for the VM
+    int trace;
+} jit_asm;
+
+void jit_byte(jit_asm *a, int b) {
+    if (a->len == a->cap) {
+        a->cap = a->cap ? a->cap * 2 : 1024;
+        a->buf = realloc(a->buf, a->cap);
+    }
+    a->buf[a->len++] = (unsigned char)b;
+}
+
+void jit_emit(jit_asm *a, int n, ...) {
+    va_list va;
+    va_start(va, n);
+    for (int i = 0;i < n;i++) jit_byte(a, va_arg(va, int));
+    va_end(va);
+}
+
+void jit_emit32(jit_asm *a, int32_t x) {
+    for (int i = 0;i < 4;i++) jit_byte(a, ((uint32_t)x >> (8 * i)) & 0xff);
+}
+
+void jit_emit64(jit_asm *a, uint64_t x) {
+    for (int i = 0;i < 8;i++) jit_byte(a, (x >> (8 * i)) & 0xff);
+}
+
+void jit_patch(jit_asm *a, int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(a->buf + at, &rel, 4);
+}
+
+// a rel32 jump, op being e9 or the 0f 8x of a jcc, to bytecode pc
+void jit_jump(jit_asm *a, int op, int pc, int deopt) {
+    if (a->trace) deopt = 0;
+    if (op != 0xe9) jit_byte(a, 0x0f);
+    jit_byte(a, op);
+    if (a->fixup_count == a->fixup_cap) {
+        a->fixup_cap = a->fixup_cap ? a->fixup_cap * 2 : 32;
+        a->fixups = realloc(a->fixups, sizeof(a->fixups[0]) * a->fixup_cap);
+    }
+    a->fixups[a->fixup_count].at = a->len;
+    a->fixups[a->fixup_count].pc = pc;
+    a->fixups[a->fixup_count].deopt = deopt;
+    a->fixup_count++;
+    jit_emit32(a, 0);
+}
+
+// a jcc to a point in the same template, patched with jit_patch
+int jit_jump_local(jit_asm *a, int op) {
+    if (op != 0xe9) jit_byte(a, 0x0f);
+    jit_byte(a, op);
+    jit_emit32(a, 0);
+    return a->len - 4;
+}
+
+#define JIT_JO  0x80
+#define JIT_JE  0x84
+#define JIT_JNE 0x85
+#define JIT_JLE 0x8e
+#define JIT_JMP 0xe9
+
+// mov reg, [r12+disp] and mov [r12+disp], rax; reg is 0 rax, 1 rcx, 2 rdx
+void jit_load(jit_asm *a, int reg, int disp) {
+    jit_emit(a, 5, 0x49, 0x8b, 0x44 | (reg << 3), 0x24, disp & 0xff);
+}
+
+void jit_store(jit_asm *a, int disp) {
+    jit_emit(a, 5, 0x49, 0x89, 0x44, 0x24, disp & 0xff);
+}
+
+// lea r12, [r12+disp], which leaves the flags alone
+void jit_drop(jit_asm *a, int disp) {
+    jit_emit(a, 5, 0x4d, 0x8d, 0x64, 0x24, disp & 0xff);
+}
+
+void jit_push_rax(jit_asm *a) {
+    jit_emit(a, 8, 0x49, 0x89, 0x04, 0x24, 0x49, 0x83, 0xc4, 0x08);
+}
+
+// r12 = helper(env, r12, arg)
+void jit_call(jit_asm *a, lval **(*helper)(lenv*, lval**, intptr_t), intptr_t arg) {
+    jit_emit(a, 6, 0x48, 0x89, 0xdf, 0x4c, 0x89, 0xe6);
+    jit_emit(a, 2, 0x48, 0xba);
+    jit_emit64(a, (uint64_t)arg);
+    jit_emit(a, 2, 0x48, 0xb8);
+    uint64_t addr;
+    memcpy(&addr, &helper, sizeof(addr));
+    jit_emit64(a, addr);
+    jit_emit(a, 5, 0xff, 0xd0, 0x49, 0x89, 0xc4);
+}
+
+// deoptimizes to pc unless rax is the builtin func
+void jit_guard_builtin(jit_asm *a, lbuiltin func, int pc) {
+    jit_emit(a, 2, 0xa8, 0x03);
+    jit_jump(a, JIT_JNE, pc, 1);
+    jit_emit(a, 2, 0x83, 0xb8);
+    jit_emit32(a, offsetof(lval, type));
+    jit_byte(a, LVAL_FUN);
+    jit_jump(a, JIT_JNE, pc, 1);
+    jit_emit(a, 2, 0x48, 0xb9);
+    uint64_t addr;
+    memcpy(&addr, &func, sizeof(addr));
+    jit_emit64(a, addr);
+    jit_emit(a, 3, 0x48, 0x39, 0x88);
+    jit_emit32(a, offsetof(lval, builtin));
+    jit_jump(a, JIT_JNE, pc, 1);
+}
+
+// rax = frame slot named by x. When the frame does not have it there the
+// code deoptimizes to deopt_pc, or if that is -1 takes the two jumps left
+// in fail for the caller to patch.
+void jit_local(jit_asm *a, int slot, lval *x, int deopt_pc, int *fail) {
+    jit_emit(a, 2, 0x81, 0xbb);
+    jit_emit32(a, offsetof(lenv, count));
+    jit_emit32(a, slot);
+    if (deopt_pc >= 0) jit_jump(a, JIT_JLE, deopt_pc, 1);
+    else fail[0] = jit_jump_local(a, JIT_JLE);
+    jit_emit(a, 3, 0x48, 0x8b, 0x83);
+    jit_emit32(a, offsetof(lenv, syms));
+    jit_emit(a, 3, 0x48, 0x8b, 0x80);
+    jit_emit32(a, slot * 8);
+    jit_emit(a, 2, 0x48, 0xb9);
+    jit_emit64(a, (uintptr_t)x->sym);
+    jit_emit(a, 3, 0x48, 0x39, 0xc8);
+    if (deopt_pc >= 0) jit_jump(a, JIT_JNE, deopt_pc, 1);
+    else fail[1] = jit_jump_local(a, JIT_JNE);
+    jit_emit(a, 3, 0x48, 0x8b, 0x83);
+    jit_emit32(a, offsetof(lenv, vals));
+    jit_emit(a, 3, 0x48, 0x8b, 0x80);
+    jit_emit32(a, slot * 8);
+}
+
+// condition codes of the comparison opcodes, for setcc and jcc
+int jit_cc(int op) {
+    switch (op) {
+        case LOP_LT: return 0xc;
+        case LOP_LE: return 0xe;
+        case LOP_GT: return 0xf;
+        case LOP_GE: return 0xd;
+        case LOP_EQ: return 0x4;
+    }
+    return 0x5;
+}
+
+// rax = rcx op rdx on fixnums, deoptimizing to pc if they are not or the
+// result overflows one
+void jit_num_op(jit_asm *a, int op, int pc) {
+    jit_emit(a, 3, 0xf6, 0xc1, 0x01);
+    jit_jump(a, JIT_JE, pc, 1);
+    jit_emit(a, 3, 0xf6, 0xc2, 0x01);
+    jit_jump(a, JIT_JE, pc, 1);
+    switch (op) {
+        case LOP_ADD:
+            jit_emit(a, 7, 0x48, 0x8d, 0x41, 0xff, 0x48, 0x01, 0xd0);
+            jit_jump(a, JIT_JO, pc, 1);
+            break;
+        case LOP_SUB:
+            jit_emit(a, 6, 0x48, 0x89, 0xc8, 0x48, 0x29, 0xd0);
+            jit_jump(a, JIT_JO, pc, 1);
+            jit_emit(a, 4, 0x48, 0x83, 0xc8, 0x01);
+            break;
+        case LOP_MUL:
+            jit_emit(a, 11, 0x48, 0x8d, 0x41, 0xff, 0x48, 0xd1, 0xfa, 0x48, 0x0f, 0xaf, 0xc2);
+            jit_jump(a, JIT_JO, pc, 1);
+            jit_emit(a, 4, 0x48, 0x83, 0xc8, 0x01);
+            break;
+        default:
+            // cmp rcx, rdx; setcc al; movzx eax, al; lea rax, [rax*4+2]
+            jit_emit(a, 3, 0x48, 0x39, 0xd1);
+            jit_emit(a, 3, 0x0f, 0x90 | jit_cc(op), 0xc0);
+            jit_emit(a, 3, 0x0f, 0xb6, 0xc0);
+            jit_emit(a, 4, 0x48, 0x8d, 0x04, 0x85);
+            jit_emit32(a, 2);
+            break;
+    }
+}
+
+// the builtin the arithmetic or comparison opcode op belongs to
+lbuiltin jit_op_builtin(int op) {
+    for (size_t i = 0;i < sizeof(lval_builtins) / sizeof(lval_builtins[0]);i++)
+        if (lval_builtins[i].op == op) return lval_builtins[i].func;
+    return NULL;
+}
+
+// the runtime side of the opcodes the native code does not inline, each
+// taking and returning the stack pointer
+lval **jit_sync(lval **sp) {
+    gc_stack_count = sp - (lval**)gc_stack;
+    return sp;
+}
+
+lval **jit_push(lval *x) {
+    gc_push(x);
+    return (lval**)gc_stack + gc_stack_count;
+}
+
+lval **jit_sym(lenv *env, lval **sp, intptr_t x) {
+    jit_sync(sp);
+    return jit_push(lval_eval(env, (lval*)x));
+}
+
+lval **jit_single(lenv *env, lval **sp, intptr_t unused) {
+    (void)unused;
+    jit_sync(sp);
+    lval *x = lval_vm_single(env, VM_TOP(0));
+    VM_TOP(0) = x;
+    return (lval**)gc_stack + gc_stack_count;
+}
+
+lval **jit_call_any(lenv *env, lval **sp, intptr_t n) {
+    jit_sync(sp);
+    lval *x = lval_vm_call(env, n);
+    gc_pop_to(gc_stack_count - n);
+    return jit_push(x);
+}
+
+lval **jit_call_builtin(lenv *env, lval **sp, intptr_t n) {
+    jit_sync(sp);
+    lval *x = lval_vm_call_builtin(env, n);
+    gc_pop_to(gc_stack_count - n);
+    return jit_push(x);
+}
+
+lval **jit_binop(lenv *env, lval **sp, intptr_t op) {
+    jit_sync(sp);
+    lval_vm_binop(env, op);
+    return (lval**)gc_stack + gc_stack_count;
+}
+
+// emits the template of the opcode at pc, returning the pc after it
+int jit_op(jit_asm *as, lcode *code, int pc) {
+    int *ops = code->ops;
+    lval **pool = code->pool;
+    int at = pc;
+    switch (ops[pc++]) {
+        case OP_CONST:
+            jit_emit(as, 2, 0x48, 0xb8);
+            jit_emit64(as, (uintptr_t)pool[ops[pc++]]);
+            jit_push_rax(as);
+            break;
+        case OP_CONSTHINT: {
+            lval *x = pool[ops[pc++]];
+            jit_emit(as, 2, 0x48, 0xb8);
+            jit_emit64(as, (uintptr_t)x);
+            jit_emit(as, 3, 0x48, 0x8b, 0x88);
+            jit_emit32(as, offsetof(lval, epoch));
+            jit_emit(as, 2, 0x48, 0xba);
+            jit_emit64(as, (uintptr_t)&lenv_const_epoch);
+            jit_emit(as, 3, 0x48, 0x3b, 0x0a);
+            int stale = jit_jump_local(as, JIT_JNE);
+            jit_emit(as, 2, 0x48, 0xba);
+            jit_emit64(as, (uintptr_t)&x->sym->local);
+            jit_emit(as, 3, 0x83, 0x3a, 0x00);
+            int shadowed = jit_jump_local(as, JIT_JNE);
+            jit_emit(as, 3, 0x48, 0x8b, 0x80);
+            jit_emit32(as, offsetof(lval, constant));
+            jit_push_rax(as);
+            int done = jit_jump_local(as, JIT_JMP);
+            jit_patch(as, stale, as->len);
+            jit_patch(as, shadowed, as->len);
+            jit_call(as, jit_sym, (intptr_t)x);
+            jit_patch(as, done, as->len);
+            break;
+        }
+        case OP_LOCAL: {
+            int slot = ops[pc++];
+            lval *x = pool[ops[pc++]];
+            int fail[2];
+            jit_local(as, slot, x, -1, fail);
+            jit_push_rax(as);
+            int done = jit_jump_local(as, JIT_JMP);
+            jit_patch(as, fail[0], as->len);
+            jit_patch(as, fail[1], as->len);
+            jit_call(as, jit_sym, (intptr_t)x);
+            jit_patch(as, done, as->len);
+            break;
+        }
+        case OP_SYM:
+            jit_call(as, jit_sym, (intptr_t)pool[ops[pc++]]);
+            break;
+        case OP_SINGLE:
+            jit_call(as, jit_single, 0);
+            break;
+        case OP_CALL:
+            jit_call(as, jit_call_any, ops[pc++]);
+            break;
+        case OP_TAILCALL:
+            // left to the VM, which runs the callee in place of this call
+            jit_jump(as, JIT_JMP, at, 1);
+            pc++;
+            break;
+        case OP_CALL_BUILTIN:
+            jit_call(as, jit_call_builtin, ops[pc++]);
+            break;
+        case OP_BINOP: {
+            int op = ops[pc++];
+            if (op == LOP_DIV) {
+                jit_call(as, jit_binop, op);
+                break;
+            }
+            jit_load(as, 0, -24);
+            jit_guard_builtin(as, jit_op_builtin(op), at);
+            jit_load(as, 1, -16);
+            jit_load(as, 2, -8);
+            jit_num_op(as, op, at);
+            jit_drop(as, -16);
+            jit_store(as, -8);
+            break;
+        }
+        case OP_BINOP_LC: {
+            int op = ops[pc++];
+            int slot = ops[pc++];
+            lval *x = pool[ops[pc++]];
+            lval *k = pool[ops[pc++]];
+            if (op == LOP_DIV || !LVAL_IS_FIXNUM(k)) {
+                jit_jump(as, JIT_JMP, at, 1);
+                break;
+            }
+            jit_load(as, 0, -8);
+            jit_guard_builtin(as, jit_op_builtin(op), at);
+            jit_local(as, slot, x, at, NULL);
+            // mov rcx, rax; mov rdx, k
+            jit_emit(as, 3, 0x48, 0x89, 0xc1);
+            jit_emit(as, 2, 0x48, 0xba);
+            jit_emit64(as, (uintptr_t)k);
+            jit_num_op(as, op, at);
+            jit_store(as, -8);
+            break;
+        }
+        case OP_IF: {
+            int else_pc = ops[pc];
+            pc += 3;
+            jit_load(as, 0, -16);
+            jit_guard_builtin(as, lval_if_builtin, at);
+            // cond must be a boolean: 6 goes on, 2 to else_pc
+            jit_load(as, 1, -8);
+            jit_emit(as, 4, 0x48, 0x83, 0xf9, 0x06);
+            int yes = jit_jump_local(as, JIT_JE);
+            jit_emit(as, 4, 0x48, 0x83, 0xf9, 0x02);
+            jit_jump(as, JIT_JNE, at, 1);
+            jit_drop(as, -16);
+            jit_jump(as, JIT_JMP, else_pc, 0);
+            jit_patch(as, yes, as->len);
+            jit_drop(as, -16);
+            break;
+        }
+        case OP_IF_CMP: {
+            int op = ops[pc];
+            int else_pc = ops[pc + 1];
+            pc += 4;
+            jit_load(as, 0, -32);
+            jit_guard_builtin(as, lval_if_builtin, at);
+            jit_load(as, 0, -24);
+            jit_guard_builtin(as, jit_op_builtin(op), at);
+            jit_load(as, 1, -16);
+            jit_load(as, 2, -8);
+            jit_emit(as, 3, 0xf6, 0xc1, 0x01);
+            jit_jump(as, JIT_JE, at, 1);
+            jit_emit(as, 3, 0xf6, 0xc2, 0x01);
+            jit_jump(as, JIT_JE, at, 1);
+            jit_emit(as, 3, 0x48, 0x39, 0xd1);
+            jit_drop(as, -32);
+            jit_jump(as, 0x80 | (jit_cc(op) ^ 1), else_pc, 0);
+            break;
+        }
+        case OP_JUMP:
+            jit_jump(as, JIT_JMP, ops[pc++], 0);
+            break;
+        case OP_RETURN:
+            // mov rax, -1
+            jit_emit(as, 7, 0x48, 0xc7, 0xc0, 0xff, 0xff, 0xff, 0xff);
+            jit_jump(as, JIT_JMP, -1, 0);
+            break;
+    }
+    return pc;
+}
+
+// Loops are self-recursive lambdas, so the one hot lambda of a loop gets
+// its trace recorded on the call that makes it hot: the VM notes which
+// way every if goes until the body either calls the lambda itself in
+// tail position, completing the trace, or does anything else, aborting
+// it. The trace is compiled ahead of the baseline code as a native loop:
+// the path runs straight through, every if checks the recorded direction,
+// and the tail call writes its arguments into the frame and jumps back.
+// A failed guard or an if going the other way is a side exit into the
+// baseline code of that opcode, which has the same stack. The frame is
+// reused in place, so a trace runs only opcodes that cannot capture it
+// and only loops on immediate arguments, which need no write barrier.
+static lenv *jit_trace_env;
+static lval *jit_trace_fun;
+static int *jit_trace;
+static int jit_trace_count;
+static int jit_trace_cap;
+
+// whether the code has a tail call a trace could end in
+int jit_loops(lcode *code) {
+    for (int pc = 0;pc < code->count;pc += 1 + lcode_op_len(code->ops[pc]))
+        if (code->ops[pc] == OP_TAILCALL) return 1;
+    return 0;
+}
+
+void jit_compile(lval *fun, int *trace, int count);
+
+// fun has become hot in the activation running on env
+void jit_hot(lenv *env, lval *fun) {
+    if (jit_trace_env != NULL || !jit_loops(fun->code)) {
+        jit_compile(fun, NULL, 0);
+        return;
+    }
+    jit_trace_env = env;
+    jit_trace_fun = fun;
+    jit_trace_count = 0;
+}
+
+void jit_record_branch(int taken) {
+    if (jit_trace_count == jit_trace_cap) {
+        jit_trace_cap = jit_trace_cap ? jit_trace_cap * 2 : 16;
+        jit_trace = realloc(jit_trace, sizeof(int) * jit_trace_cap);
+    }
+    jit_trace[jit_trace_count++] = taken;
+}
+
+void jit_record_end(int looped) {
+    jit_trace_env = NULL;
+    if (!looped) jit_traces_aborted++;
+    jit_compile(jit_trace_fun, looped ? jit_trace : NULL, jit_trace_count);
+}
+
+#define JIT_RECORD_BRANCH(env, taken) if (jit_trace_env == (env)) jit_record_branch(taken)
+#define JIT_RECORD_END(env, looped) if (jit_trace_env == (env)) jit_record_end(looped)
+
+// emits the loop for the recorded path through fun, returning 0 if the
+// path has an opcode the loop cannot run
+int jit_trace_loop(jit_asm *as, lval *fun, int *trace, int count) {
+    lcode *code = fun->code;
+    int *ops = code->ops;
+    if (fun->arity < 0) return 0;
+
+    // the frame must hold just the formals, in order, in storage of its own
+    jit_emit(as, 2, 0x81, 0xbb);
+    jit_emit32(as, offsetof(lenv, count));
+    jit_emit32(as, fun->arity);
+    jit_jump(as, JIT_JNE, 0, 0);
+    jit_emit(as, 3, 0x48, 0x83, 0xbb);
+    jit_emit32(as, offsetof(lenv, shared));
+    jit_byte(as, 0);
+    jit_jump(as, JIT_JNE, 0, 0);
+    jit_emit(as, 3, 0x48, 0x8b, 0x83);
+    jit_emit32(as, offsetof(lenv, syms));
+    for (int i = 0;i < fun->arity;i++) {
+        jit_emit(as, 2, 0x48, 0xb9);
+        jit_emit64(as, (uintptr_t)fun->formals->cell[i]->sym);
+        jit_emit(as, 3, 0x48, 0x39, 0x88);
+        jit_emit32(as, i * 8);
+        jit_jump(as, JIT_JNE, 0, 0);
+    }
+    // inc qword [jit_traces_executed]
+    jit_emit(as, 2, 0x48, 0xb8);
+    jit_emit64(as, (uintptr_t)&jit_traces_executed);
+    jit_emit(as, 3, 0x48, 0xff, 0x00);
+
+    int loop = as->len;
+    int pc = 0, t = 0;
+    while (1) {
+        int at = pc;
+        switch (ops[pc]) {
+            case OP_CONST:
+            case OP_CONSTHINT:
+            case OP_LOCAL:
+            case OP_SYM:
+                pc = jit_op(as, code, pc);
+                break;
+            case OP_BINOP:
+            case OP_BINOP_LC:
+                if (ops[pc + 1] == LOP_DIV) return 0;
+                pc = jit_op(as, code, pc);
+                break;
+            case OP_IF: {
+                if (t == count) return 0;
+                int then_pc = pc + 4, else_pc = ops[pc + 1];
+                int taken = trace[t++];
+                jit_load(as, 0, -16);
+                jit_guard_builtin(as, lval_if_builtin, at);
+                // cmp rcx, taken ? 6 : 2 goes on along the trace
+                jit_load(as, 1, -8);
+                jit_emit(as, 4, 0x48, 0x83, 0xf9, taken ? 0x06 : 0x02);
+                int on = jit_jump_local(as, JIT_JE);
+                jit_emit(as, 4, 0x48, 0x83, 0xf9, taken ? 0x02 : 0x06);
+                jit_jump(as, JIT_JNE, at, 0);
+                jit_drop(as, -16);
+                jit_jump(as, JIT_JMP, taken ? else_pc : then_pc, 0);
+                jit_patch(as, on, as->len);
+                jit_drop(as, -16);
+                pc = taken ? then_pc : else_pc;
+                break;
+            }
+            case OP_IF_CMP: {
+                if (t == count) return 0;
+                int op = ops[pc + 1];
+                int then_pc = pc + 5, else_pc = ops[pc + 2];
+                int taken = trace[t++];
+                jit_load(as, 0, -32);
+                jit_guard_builtin(as, lval_if_builtin, at);
+                jit_load(as, 0, -24);
+                jit_guard_builtin(as, jit_op_builtin(op), at);
+                jit_load(as, 1, -16);
+                jit_load(as, 2, -8);
+                jit_emit(as, 3, 0xf6, 0xc1, 0x01);
+                jit_jump(as, JIT_JE, at, 0);
+                jit_emit(as, 3, 0xf6, 0xc2, 0x01);
+                jit_jump(as, JIT_JE, at, 0);
+                jit_emit(as, 3, 0x48, 0x39, 0xd1);
+                jit_drop(as, -32);
+                if (taken) jit_jump(as, 0x80 | (jit_cc(op) ^ 1), else_pc, 0);
+                else jit_jump(as, 0x80 | jit_cc(op), then_pc, 0);
+                pc = taken ? then_pc : else_pc;
+                break;
+            }
+            case OP_JUMP:
+                pc = ops[pc + 1];
+                break;
+            case OP_TAILCALL: {
+                int n = ops[pc + 1];
+                if (n - 1 != fun->arity || n > 15) return 0;
+                // the callee must be fun itself and the arguments immediates
+                jit_load(as, 0, -8 * n);
+                jit_emit(as, 2, 0x48, 0xb9);
+                jit_emit64(as, (uintptr_t)fun);
+                jit_emit(as, 3, 0x48, 0x39, 0xc8);
+                jit_jump(as, JIT_JNE, at, 0);
+                for (int i = 1;i < n;i++) {
+                    jit_load(as, 0, -8 * (n - i));
+                    jit_emit(as, 2, 0xa8, 0x03);
+                    jit_jump(as, JIT_JE, at, 0);
+                }
+                // mov rdx, [rbx+vals]; mov [rdx+8i], rax for each argument
+                jit_emit(as, 3, 0x48, 0x8b, 0x93);
+                jit_emit32(as, offsetof(lenv, vals));
+                for (int i = 1;i < n;i++) {
+                    jit_load(as, 0, -8 * (n - i));
+                    jit_emit(as, 3, 0x48, 0x89, 0x82);
+                    jit_emit32(as, (i - 1) * 8);
+                }
+                jit_drop(as, -8 * n);
+                jit_patch(as, jit_jump_local(as, JIT_JMP), loop);
+                return 1;
+            }
+            default:
+                return 0;
+        }
+    }
+}
+
+// compiles fun, with a loop for the recorded path trace if it has one
+void jit_compile(lval *fun, int *trace, int count) {
+    lcode *code = fun->code;
+    int *native_pc = malloc(sizeof(int) * (code->count + 1));
+    jit_asm a = {0};
+    jit_asm *as = &a;
+
+    // push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi
+    jit_emit(as, 11, 0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4);
+    if (trace != NULL) {
+        int len = as->len, fixups = as->fixup_count;
+        as->trace = 1;
+        if (jit_trace_loop(as, fun, trace, count))
+            jit_traces_recorded++;
+        else {
+            as->len = len;
+            as->fixup_count = fixups;
+            jit_traces_aborted++;
+        }
+        as->trace = 0;
+    }
+    int pc = 0;
+    while (pc < code->count) {
+        native_pc[pc] = as->len;
+        pc = jit_op(as, code, pc);
+    }
+    native_pc[code->count] = as->len;
+
+    // mov rdx, r12; pop r13; pop r12; pop rbx; ret
+    int leave = as->len;
+    jit_emit(as, 8, 0x4c, 0x89, 0xe2, 0x41, 0x5d, 0x41, 0x5c, 0x5b);
+    jit_byte(as, 0xc3);
+
+    // each deoptimizing jump gets an exit returning its pc: mov eax, pc
+    int fixups = as->fixup_count;
+    for (int i = 0;i < fixups;i++) {
+        if (as->fixups[i].pc < 0) {
+            jit_patch(as, as->fixups[i].at, leave);
+            continue;
+        }
+        if (!as->fixups[i].deopt) {
+            jit_patch(as, as->fixups[i].at, native_pc[as->fixups[i].pc]);
+            continue;
+        }
+        jit_patch(as, as->fixups[i].at, as->len);
+        jit_byte(as, 0xb8);
+        jit_emit32(as, as->fixups[i].pc);
+        jit_emit(as, 1, 0xe9);
+        jit_emit32(as, leave - (as->len + 4));
+    }
+
+    size_t size = (as->len + 4095) & ~(size_t)4095;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+        memcpy(mem, as->buf, as->len);
+        mprotect(mem, size, PROT_READ | PROT_EXEC);
+        code->native.bytes = mem;
+        code->native_size = size;
+    }
+    else
+        code->deopts = JIT_MAX_DEOPTS;
+    free(as->buf);
+    free(as->fixups);
+    free(native_pc);
+}
+
+// runs the native code of fun, returning the pc the VM has to go on from
+// or -1 when the result is on top of the stack
+int jit_run(lenv *env, lcode *code) {
+    while (gc_stack_count + code->count >= gc_stack_cap) {
+        gc_stack_cap *= 2;
+        gc_stack = realloc(gc_stack, sizeof(void*) * gc_stack_cap);
+    }
+    jit_exit ans = code->native.enter(env, (lval**)gc_stack + gc_stack_count);
+    jit_sync(ans.sp);
+    if (ans.pc >= 0 && code->ops[ans.pc] != OP_TAILCALL) code->deopts++;
+    return ans.pc;
+}
+#else
+#define JIT_RECORD_BRANCH(env, taken)
+#define JIT_RECORD_END(env, looped)
+#endif
+
+// GCC builds get a threaded loop: every handler jumps straight to the next
+// one through a table of label addresses, so each opcode has its own
+// indirect branch for the predictor to learn. Other compilers, or a build
+// with -DLISP_SWITCH_DISPATCH, get the plain switch.
+#if defined(__GNUC__) && !defined(LISP_SWITCH_DISPATCH)
+#define VM_THREADED
+#endif
+
+#ifdef VM_THREADED
+#define VM_CASE(op) L_##op:
+#define VM_NEXT __extension__ ({ goto *vm_labels[ops[pc++]]; })
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT continue
+#endif
+
+lval *lval_vm_run(lenv *env, lval *fun) {
+#ifdef VM_THREADED
+    // in the order of the opcodes
+    static void *vm_labels[] = {
+        __extension__ &&L_OP_CONST, __extension__ &&L_OP_CONSTHINT,
+        __extension__ &&L_OP_LOCAL, __extension__ &&L_OP_SYM,
+        __extension__ &&L_OP_SINGLE, __extension__ &&L_OP_CALL,
+        __extension__ &&L_OP_TAILCALL, __extension__ &&L_OP_CALL_BUILTIN,
+        __extension__ &&L_OP_BINOP,
+        __extension__ &&L_OP_BINOP_LC, __extension__ &&L_OP_IF,
+        __extension__ &&L_OP_IF_CMP, __extension__ &&L_OP_JUMP,
+        __extension__ &&L_OP_RETURN
+    };
+#endif
+    int base = gc_stack_count;
+    lcode *code;
+    int *ops;
+    lval **pool;
+    int pc;
+
+    // a tail call comes back here to run the callee in place of fun
+enter:
+    gc_pop_to(base);
+    gc_push(fun);
+    gc_push(env);
+    gc_safe_point();
+
+    code = fun->code;
+    ops = code->ops;
+    pool = code->pool;
+    pc = 0;
+#ifdef VM_JIT
+    if (code->deopts < JIT_MAX_DEOPTS && jit_enabled) {
+        if (code->native.bytes == NULL && ++code->calls == JIT_THRESHOLD) jit_hot(env, fun);
+        if (code->native.bytes != NULL) pc = jit_run(env, code);
+        if (pc < 0) {
+            lval *x = VM_TOP(0);
+            gc_pop_to(base);
+            return x;
+        }
+    }
+#endif
+#ifdef VM_THREADED
+    VM_NEXT;
+#else
+    while (1) switch (ops[pc++]) {
+#endif
+        VM_CASE(OP_CONST)
+            gc_push(pool[ops[pc++]]);
+            VM_NEXT;
+        VM_CASE(OP_CONSTHINT) {
+            lval *x = pool[ops[pc++]];
+            gc_push(x->epoch == lenv_const_epoch && !x->sym->local ? x->constant : lval_eval(env, x));
+            VM_NEXT;
+        }
+        VM_CASE(OP_LOCAL) {
+            int slot = ops[pc++];
+            lval *x = pool[ops[pc++]];
+            if (slot < env->count && env->syms[slot] == x->sym)
+                gc_push(env->vals[slot]);
+            else
+                gc_push(lval_eval(env, x));
+            VM_NEXT;
+        }
+        VM_CASE(OP_SYM)
+            gc_push(lval_eval(env, pool[ops[pc++]]));
+            VM_NEXT;
+        VM_CASE(OP_SINGLE) {
+            JIT_RECORD_END(env, 0);
+            lval *x = lval_vm_single(env, VM_TOP(0));
+            VM_TOP(0) = x;
+            VM_NEXT;
+        }
+        VM_CASE(OP_CALL) {
+            int n = ops[pc++];
+            JIT_RECORD_END(env, 0);
+            lval *x = lval_vm_call(env, n);
+            gc_pop_to(gc_stack_count - n);
+            gc_push(x);
+            VM_NEXT;
+        }
+        VM_CASE(OP_TAILCALL) {
+            int n = ops[pc++];
+            JIT_RECORD_END(env, VM_TOP(n - 1) == fun);
+            lval *f;
+            lenv *frame;
+            lval *x = lval_vm_tail(env, n, &f, &frame);
+            if (x == NULL && f->code != NULL) {
+                fun = f;
+                env = frame;
+                goto enter;
+            }
+            if (x == NULL) x = lval_eval_s_expression(frame, f->body);
+            gc_pop_to(gc_stack_count - n);
+            gc_push(x);
+            VM_NEXT;
+        }
+        VM_CASE(OP_CALL_BUILTIN) {
+            int n = ops[pc++];
+            JIT_RECORD_END(env, 0);
+            int roots = gc_stack_count - n;
+            lval *x = lval_vm_call_builtin(env, n);
+            gc_pop_to(roots);
+            gc_push(x);
+            VM_NEXT;
+        }
+        VM_CASE(OP_BINOP)
+            lval_vm_binop(env, ops[pc++]);
+            VM_NEXT;
+        VM_CASE(OP_BINOP_LC) {
+            int op = ops[pc++];
+            int slot = ops[pc++];
+            lval *x = pool[ops[pc++]];
+            lval *k = pool[ops[pc++]];
+            lval *f = VM_TOP(0);
+            if (slot < env->count && env->syms[slot] == x->sym) {
+                lval *a = env->vals[slot];
+                if (LVAL_TYPE(f) == LVAL_FUN && f->builtin != NULL && f->desc->op == op
+                    && LVAL_TYPE(a) == LVAL_NUM) {
+                    VM_TOP(0) = lval_num_op(op, a, k);
+                    VM_NEXT;
+                }
+                gc_push(a);
+            }
+            else
+                gc_push(lval_eval(env, x));
+            gc_push(k);
+            lval_vm_binop(env, op);
+            VM_NEXT;
+        }
+        VM_CASE(OP_IF_CMP) {
+            int op = ops[pc++];
+            lval *g = VM_TOP(3), *f = VM_TOP(2), *a = VM_TOP(1), *b = VM_TOP(0);
+            if (LVAL_TYPE(g) == LVAL_FUN && g->builtin == lval_if_builtin
+                && LVAL_TYPE(f) == LVAL_FUN && f->builtin != NULL && f->desc->op == op
+                && LVAL_TYPE(a) == LVAL_NUM && LVAL_TYPE(b) == LVAL_NUM) {
+                gc_pop_to(gc_stack_count - 4);
+                int taken = LVAL_GET_NUM(lval_num_op(op, a, b)) == 1;
+                JIT_RECORD_BRANCH(env, taken);
+                pc = taken ? pc + 3 : ops[pc];
+                VM_NEXT;
+            }
+            lval_vm_binop(env, op);
+            goto vm_if;
+        }
+        VM_CASE(OP_IF)
+        vm_if: {
+            int else_pc = ops[pc++];
+            int end_pc = ops[pc++];
+            lval *cur = pool[ops[pc++]];
+            lval *f = VM_TOP(1), *cond = VM_TOP(0);
+            if (LVAL_TYPE(f) == LVAL_FUN && f->builtin == lval_if_builtin && LVAL_TYPE(cond) == LVAL_BOOL) {
+                gc_pop_to(gc_stack_count - 2);
+                JIT_RECORD_BRANCH(env, LVAL_GET_NUM(cond) == 1);
+                if (LVAL_GET_NUM(cond) != 1) pc = else_pc;
+                VM_NEXT;
+            }
+            JIT_RECORD_END(env, 0);
+            gc_push(cur->cell[2]);
+            gc_push(cur->cell[3]);
+            lval *x = lval_vm_call(env, 4);
+            gc_pop_to(gc_stack_count - 4);
+            gc_push(x);
+            pc = end_pc;
+            VM_NEXT;
+        }
+        VM_CASE(OP_JUMP)
+            pc = ops[pc];
+            VM_NEXT;
+        VM_CASE(OP_RETURN) {
+            JIT_RECORD_END(env, 0);
+            lval *x = VM_TOP(0);
+            gc_pop_to(base);
+            return x;
+        }
+#ifndef VM_THREADED
+    }
+#endif
+}
+
+lval *lval_run(lenv *frame, lval *fun) {
+    if (fun->code != NULL) return lval_vm_run(frame, fun);
+    return lval_eval_s_expression(frame, fun->body);
+}
+
 int main(int argc, char *argv[]) {
     // printf("\\\n");
     Number = mpc_new("number");
@@ -1005,28 +3649,56 @@ int main(int argc, char *argv[]) {
     Number, Symbol, String, Comment, S_expression, Q_expression, Expression, Lispy, NULL
     );
 
+    lsym_varargs = lsym_intern("&");
+
     lenv *env = lenv_make();
+    gc_register_root(env);
+    lenv_global = env;
     lenv_add_functions(env);
 
     if (argc >= 2) {
         for (int i = 1;i < argc;i++) {
+            if (strncmp(argv[i], "--gc-budget-us=", 15) == 0) {
+                gc_budget_us = atol(argv[i] + 15);
+                continue;
+            }
+            if (strcmp(argv[i], "--no-hashcons") == 0) {
+                hashcons_enabled = 0;
+                continue;
+            }
+            if (strcmp(argv[i], "--no-vm") == 0) {
+                vm_enabled = 0;
+                continue;
+            }
+#ifdef VM_JIT
+            if (strcmp(argv[i], "--no-jit") == 0) {
+                jit_enabled = 0;
+                continue;
+            }
+#endif
+            if (strcmp(argv[i], "--mutable-builtins") == 0) {
+                lenv_thaw_builtins(env);
+                continue;
+            }
+            // load is done with cur before it evaluates anything
             lval *cur = lval_add(lval_make_s_expr(), lval_make_str(argv[i]));
-            lval *cur_ans = lval_load_builtin(env, cur);
-            lval_print(cur_ans);
-            
-            lval_delete(cur_ans);
+            lval_print(lval_load_builtin(env, cur));
+            gc_end_form();
         }
     }
 
     while (1) {
         char *input = readline("lisp >");
+        if (input == NULL) break;
         //add_history(input);
         mpc_result_t r;
         
         if (mpc_parse("input", input, Lispy, &r)) {
-            lval *ans = lval_read(r.output); 
-            // lval_print(ans);
-            lval_print(lval_eval(env, ans));
+            lval *expr = lval_read(r.output);
+            gc_push(expr);
+            lval_print(lval_eval(env, expr));
+            gc_pop_to(0);
+            gc_end_form();
             printf("\n");
             // mpc_ast_print(r.output);
             mpc_ast_delete(r.output);